@@ -11,6 +11,16 @@
 /* ioctl codes availables in ccontrol:
  * CCONTROL_IO_INFO: get info on module
  * CCONTROL_IO_CONFIG: set area config (block cyclic coloring)
+ * CCONTROL_IO_APPEND: add pages with a new layout at the end of a configured area
+ * CCONTROL_IO_TRUNCATE: release pages at the end of an area (keeps the given number of pages)
+ * CCONTROL_IO_RECOLOR: move a range of area pages to pages of other colors (content is kept)
+ * CCONTROL_IO_NAME: name the area, which then persists until unlinked
+ * CCONTROL_IO_ATTACH: use a named area instead of the new area of the file (before config or mmap)
+ * CCONTROL_IO_UNLINK: remove an area name (area is destroyed when no file uses it anymore)
+ * CCONTROL_IO_CONFIG_SEGMENTS: set area config as a sequence of layouts (one ioctl for several segments)
+ * CCONTROL_IO_CONFIG_MAP: set area config as an explicit color map (run-length encoded)
+ * CCONTROL_IO_CLAIM: join a group of files and claim colors for it exclusively (areas configured later are charged to it)
+ * CCONTROL_IO_QUERY: get the colors of the pages of a virtual range of the caller (not only areas)
  */
 
 #ifndef CCONTROL_IOCTL_H
@@ -24,6 +34,16 @@
 
 #define CCONTROL_IO_INFO _IOW(CCONTROL_IO_MAGIC, 0, struct cc_module_info *)
 #define CCONTROL_IO_CONFIG _IOR(CCONTROL_IO_MAGIC, 1, struct cc_layout *)
-#define CCONTROL_IO_NR 2
+#define CCONTROL_IO_APPEND _IOR(CCONTROL_IO_MAGIC, 2, struct cc_layout *)
+#define CCONTROL_IO_TRUNCATE _IOR(CCONTROL_IO_MAGIC, 3, size_t *)
+#define CCONTROL_IO_RECOLOR _IOR(CCONTROL_IO_MAGIC, 4, struct cc_recolor *)
+#define CCONTROL_IO_NAME _IOR(CCONTROL_IO_MAGIC, 5, struct cc_area_name *)
+#define CCONTROL_IO_ATTACH _IOWR(CCONTROL_IO_MAGIC, 6, struct cc_area_name *)
+#define CCONTROL_IO_UNLINK _IOR(CCONTROL_IO_MAGIC, 7, struct cc_area_name *)
+#define CCONTROL_IO_CONFIG_SEGMENTS _IOR(CCONTROL_IO_MAGIC, 8, struct cc_segments *)
+#define CCONTROL_IO_CONFIG_MAP _IOR(CCONTROL_IO_MAGIC, 9, struct cc_color_map *)
+#define CCONTROL_IO_CLAIM _IOR(CCONTROL_IO_MAGIC, 10, struct cc_claim *)
+#define CCONTROL_IO_QUERY _IOWR(CCONTROL_IO_MAGIC, 11, struct cc_query *)
+#define CCONTROL_IO_NR 12
 
 #endif /* CCONTROL_IOCTL_H */
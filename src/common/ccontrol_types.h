@@ -10,23 +10,150 @@
 #ifndef CCONTROL_TYPES_H
 #define CCONTROL_TYPES_H
 
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h>
+#endif
+
 /** Ccontrol module info.
  */
 struct cc_module_info {
-	int nb_colors; // number of colors used in the module
+	int nb_colors; // number of colors used in the module (nb_cache_colors * nb_bank_colors)
+	int nb_cache_colors; // number of cache colors
+	int nb_bank_colors; // number of DRAM bank colors (1 without bank coloring)
+	int nb_inner_colors; // number of colors of the inner cache level (nb_cache_colors without inner level)
 	int block_size; // size of a colored block in bytes
 	int color_list_size_max; // maximum size of color list in config ioctl
+	int nb_nodes; // number of NUMA node ids (valid nodes are in [0, nb_nodes[)
 };
 
 /** Block cyclic layout.
  * cc_layout.color_list must be allocated manually.
  * Layout = [color_list[0] * color_repeat, ..., color_list[nb_colors - 1] * color_repeat] * list_repeat
+ * flags is a combination of CC_LAYOUT_* values (0 for default behavior).
  */
 struct cc_layout {
 	int *color_list;
 	int nb_colors;
 	int color_repeat;
 	int list_repeat;
+	int flags;
+	int node; // NUMA node of pages, only used with CC_LAYOUT_NODE
+};
+
+/** Recoloring of a range of an area.
+ * Pages [offset, offset + layout size[ (offset in pages) are moved to new pages following layout.
+ */
+struct cc_recolor {
+	size_t offset;
+	struct cc_layout layout;
+};
+
+/** Multi-segment configuration.
+ * The area is made of the pages of each layout, one segment after the other:
+ * segment i starts at the sum of the sizes of segments [0, i[ (in pages).
+ * Flags of the first segment apply to the whole area.
+ */
+#define CC_SEGMENTS_MAX 256
+
+struct cc_segments {
+	struct cc_layout *layouts; // array of nb_segments layouts
+	int nb_segments; // in [1, CC_SEGMENTS_MAX]
 };
 
+/** Explicit color map: the area is a sequence of runs of pages of one color, in order.
+ * The number of runs is not limited by color_list_size_max.
+ * flags accepts CC_LAYOUT_POPULATE and CC_LAYOUT_NODE.
+ */
+struct cc_color_run {
+	int color;
+	size_t nb_pages;
+};
+
+struct cc_color_map {
+	struct cc_color_run *runs; // array of nb_runs runs
+	size_t nb_runs;
+	int flags;
+	int node; // NUMA node of pages, only used with CC_LAYOUT_NODE
+};
+
+/** Name of a persistent area.
+ * A named area stays alive (with its pages and content) after every file using it is closed,
+ * until the name is unlinked. nb_pages is the area size in pages (filled by attach).
+ * The name is owned by the user naming it. mode (name only) gives read/write permission bits
+ * for the owner, group and others as for a file (0 for 0600): attach needs read and write permission,
+ * and only the owner can unlink.
+ */
+#define CC_AREA_NAME_MAX 64
+
+struct cc_area_name {
+	char name[CC_AREA_NAME_MAX]; // null terminated, not empty
+	size_t nb_pages;
+	unsigned int mode;
+};
+
+/** Color claim of a group of files.
+ * Claimed colors can only be used by areas configured from files of the group (others get EACCES),
+ * and a color can only be claimed if no area outside of the group holds pages of it or uses it in a lazy layout (EBUSY).
+ * With a quota, areas of the group can hold at most max_pages pages of each color (EDQUOT).
+ * max_pages is 0 to keep the current quota (none for a new group), or CC_CLAIM_NO_QUOTA to remove it ;
+ * only lowering the quota (or setting a first one) is allowed without CAP_SYS_ADMIN (EPERM).
+ * Files claiming with the same group name share claims and quota ; an empty name makes a group private to the file.
+ * A named group can only be joined by the user who created it (EACCES), and claiming colors
+ * (nb_colors > 0) needs CAP_SYS_ADMIN (EPERM) ; joining a group or setting a quota does not.
+ * Claims of a group last while a file or an area of the group exists.
+ */
+struct cc_claim {
+	char group[CC_AREA_NAME_MAX]; // null terminated, may be empty
+	int *color_list; // colors to claim (in addition to already claimed ones)
+	int nb_colors; // size of color_list, may be 0
+	size_t max_pages; // per color quota (0 to keep the current one, CC_CLAIM_NO_QUOTA to remove it)
+};
+#define CC_CLAIM_NO_QUOTA ((size_t) -1)
+
+/** Color query of a virtual range of the calling process (any memory, not only areas).
+ * Pages of [start, start + nb_pages * block_size[ that were never touched are skipped (not faulted in),
+ * swapped out or file pages missing from page tables may be read back.
+ * If colors is not NULL, it receives the color of each page (-1 if not present).
+ * If histogram is not NULL, it receives the number of present pages of each color (nb_colors entries).
+ * nb_present receives the number of present pages.
+ */
+struct cc_query {
+	void *start; // page aligned
+	size_t nb_pages;
+	int *colors;
+	size_t *histogram;
+	size_t nb_present;
+};
+
+/* Colors of cc_layout.color_list combine a cache color and a DRAM bank color.
+ * Without bank coloring, nb_bank_colors == 1 and colors are cache colors.
+ */
+#define CC_COLOR(info, cache_color, bank_color) ((cache_color) * (info)->nb_bank_colors + (bank_color))
+#define CC_CACHE_COLOR(info, color) ((color) / (info)->nb_bank_colors)
+#define CC_BANK_COLOR(info, color) ((color) % (info)->nb_bank_colors)
+
+/* Inner cache level (like L2): its colors are the low part of cache colors (they nest in cache colors).
+ * The (inner color, cache color) pair of a color is (CC_INNER_COLOR(info, color), CC_CACHE_COLOR(info, color)).
+ */
+#define CC_INNER_COLOR(info, color) (CC_CACHE_COLOR(info, color) % (info)->nb_inner_colors)
+
+/* Layout flags:
+ * CC_LAYOUT_POPULATE: map every page of the area at mmap time (instead of at first touch).
+ * CC_LAYOUT_NODE: take pages from node cc_layout.node (default: nearest node of the configuring cpu).
+ * CC_LAYOUT_INNER_COLORS: color_list contains inner colors (< nb_inner_colors) ; the pages of each entry
+ *   cycle through the colors nested in the inner color (spread over the outer cache and banks).
+ * CC_LAYOUT_LAZY: configure only records the layout (whatever its size) ; each page is taken from storage
+ *   at its first touch, so that sparse areas only use memory for their working set. A touch gets SIGBUS
+ *   if no page is left. Every layout of a lazy area (append, segments) must be lazy.
+ *   Not compatible with CC_LAYOUT_POPULATE, and lazy areas cannot be recolored.
+ */
+#define CC_LAYOUT_POPULATE 0x1
+#define CC_LAYOUT_NODE 0x2
+#define CC_LAYOUT_INNER_COLORS 0x4
+#define CC_LAYOUT_LAZY 0x8
+#define CC_LAYOUT_FLAGS (CC_LAYOUT_POPULATE | CC_LAYOUT_NODE | CC_LAYOUT_INNER_COLORS | CC_LAYOUT_LAZY)
+#define CC_COLOR_MAP_FLAGS (CC_LAYOUT_POPULATE | CC_LAYOUT_NODE)
+
 #endif /* CCONTROL_TYPES_H */
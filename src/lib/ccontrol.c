@@ -7,6 +7,7 @@
  * Copyright (C) 2010 Swann Perarnau <swann.perarnau@imag.fr>
  * Copyright (C) 2015 Francois Gindraud <francois.gindraud@inria.fr>
  */
+#define _GNU_SOURCE // mremap
 #include "ccontrol.h"
 
 #include <stdio.h>
@@ -19,6 +20,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <error.h>
+#include <string.h>
 
 #define ERROR_AT(s, ...) error_at_line (0, errno, __FILE__, __LINE__, s,##__VA_ARGS__)
 
@@ -68,7 +70,7 @@ int ccontrol_configure (struct ccontrol_area * area, struct cc_layout * layout)
 		return -1;
 	}
 
-	area->size = layout->nb_colors * layout->color_repeat * layout->list_repeat * area->module_info.block_size;
+	area->size = (size_t) layout->nb_colors * layout->color_repeat * layout->list_repeat * area->module_info.block_size;
 	area->start = mmap (NULL, area->size, PROT_READ | PROT_WRITE, MAP_SHARED, area->fd, 0);
 	if (area->start == MAP_FAILED) {
 		ERROR_AT ("area mmap");
@@ -78,6 +80,268 @@ int ccontrol_configure (struct ccontrol_area * area, struct cc_layout * layout)
 	return 0;
 }
 
+int ccontrol_configure_segments (struct ccontrol_area * area, struct cc_layout * layouts, int nb_segments, size_t * offsets) {
+	if (area == NULL || layouts == NULL || nb_segments < 1 || nb_segments > CC_SEGMENTS_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	size_t size = 0;
+	for (int i = 0; i < nb_segments; ++i) {
+		struct cc_layout * layout = &layouts[i];
+		if (layout->color_list == NULL || layout->nb_colors < 1 || layout->color_repeat < 1 || layout->list_repeat < 1) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (offsets != NULL)
+			offsets[i] = size;
+		size += (size_t) layout->nb_colors * layout->color_repeat * layout->list_repeat * area->module_info.block_size;
+	}
+
+	struct cc_segments segments = { .layouts = layouts, .nb_segments = nb_segments };
+	if (ioctl (area->fd, CCONTROL_IO_CONFIG_SEGMENTS, &segments) < 0) {
+		ERROR_AT ("area configure segments");
+		return -1;
+	}
+
+	area->size = size;
+	area->start = mmap (NULL, area->size, PROT_READ | PROT_WRITE, MAP_SHARED, area->fd, 0);
+	if (area->start == MAP_FAILED) {
+		ERROR_AT ("area mmap");
+		area->start = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+int ccontrol_configure_map (struct ccontrol_area * area, struct cc_color_map * map) {
+	if (area == NULL || map == NULL || map->runs == NULL || map->nb_runs == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ioctl (area->fd, CCONTROL_IO_CONFIG_MAP, map) < 0) {
+		ERROR_AT ("area configure map");
+		return -1;
+	}
+
+	size_t nb_pages = 0;
+	for (size_t i = 0; i < map->nb_runs; ++i)
+		nb_pages += map->runs[i].nb_pages;
+	area->size = nb_pages * area->module_info.block_size;
+	area->start = mmap (NULL, area->size, PROT_READ | PROT_WRITE, MAP_SHARED, area->fd, 0);
+	if (area->start == MAP_FAILED) {
+		ERROR_AT ("area mmap");
+		area->start = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* Color claims
+ *
+ * Claims belong to a group of files in the module, and last while a file or area of the group exists.
+ */
+
+int ccontrol_claim (struct ccontrol_area * area, const char * group, int * colors, int nb_colors, size_t max_pages) {
+	if (area == NULL || (group != NULL && strlen (group) >= CC_AREA_NAME_MAX) ||
+			nb_colors < 0 || (nb_colors > 0 && colors == NULL)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct cc_claim claim = { .color_list = colors, .nb_colors = nb_colors, .max_pages = max_pages };
+	strcpy (claim.group, group != NULL ? group : "");
+	if (ioctl (area->fd, CCONTROL_IO_CLAIM, &claim) < 0) {
+		ERROR_AT ("area claim");
+		return -1;
+	}
+	return 0;
+}
+
+/* Named areas
+ *
+ * A named area is kept by the module after its file descriptors are closed, until unlinked.
+ * Other processes can open it by name to get the same pages (and content).
+ */
+
+static int set_area_name (struct cc_area_name * area_name, const char * name) {
+	if (name == NULL || name[0] == '\0' || strlen (name) >= CC_AREA_NAME_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	strcpy (area_name->name, name);
+	area_name->nb_pages = 0;
+	area_name->mode = 0;
+	return 0;
+}
+
+int ccontrol_name (struct ccontrol_area * area, const char * name, unsigned int mode) {
+	struct cc_area_name area_name;
+	if (area == NULL || set_area_name (&area_name, name) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	area_name.mode = mode;
+	if (ioctl (area->fd, CCONTROL_IO_NAME, &area_name) < 0) {
+		ERROR_AT ("area name");
+		return -1;
+	}
+	return 0;
+}
+
+struct ccontrol_area * ccontrol_open (const char * name) {
+	struct cc_area_name area_name;
+	if (set_area_name (&area_name, name) < 0)
+		return NULL;
+
+	struct ccontrol_area * area = ccontrol_create ();
+	if (area == NULL)
+		return NULL;
+
+	if (ioctl (area->fd, CCONTROL_IO_ATTACH, &area_name) < 0) {
+		ERROR_AT ("area attach");
+		goto err_created;
+	}
+	if (area_name.nb_pages > 0) {
+		area->size = area_name.nb_pages * area->module_info.block_size;
+		area->start = mmap (NULL, area->size, PROT_READ | PROT_WRITE, MAP_SHARED, area->fd, 0);
+		if (area->start == MAP_FAILED) {
+			ERROR_AT ("area mmap");
+			area->start = NULL;
+			goto err_created;
+		}
+	}
+	return area;
+
+err_created:
+	ccontrol_destroy (area);
+	return NULL;
+}
+
+int ccontrol_unlink (const char * name) {
+	struct cc_area_name area_name;
+	if (set_area_name (&area_name, name) < 0)
+		return -1;
+
+	int fd = open ("/dev/ccontrol", O_RDWR);
+	if (fd == -1) {
+		ERROR_AT ("ccontrol device open");
+		return -1;
+	}
+	int err = ioctl (fd, CCONTROL_IO_UNLINK, &area_name);
+	if (err < 0)
+		ERROR_AT ("area unlink");
+	close (fd);
+	return err;
+}
+
+/* Area resizing
+ *
+ * The module adds or removes pages at the end of the area, and the mapping follows with mremap.
+ * The mapping may move when growing, existing pages keep their content.
+ */
+
+int ccontrol_append (struct ccontrol_area * area, struct cc_layout * layout) {
+	if (area == NULL || layout == NULL || layout->color_list == NULL ||
+			layout->nb_colors < 1 || layout->color_repeat < 1 || layout->list_repeat < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ioctl (area->fd, CCONTROL_IO_APPEND, layout) < 0) {
+		ERROR_AT ("area append");
+		return -1;
+	}
+
+	size_t new_size = area->size + (size_t) layout->nb_colors * layout->color_repeat * layout->list_repeat * area->module_info.block_size;
+	void * new_start;
+	if (area->start == NULL)
+		// area was truncated to 0
+		new_start = mmap (NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, area->fd, 0);
+	else
+		new_start = mremap (area->start, area->size, new_size, MREMAP_MAYMOVE);
+	if (new_start == MAP_FAILED) {
+		ERROR_AT ("area mremap");
+		return -1;
+	}
+	area->start = new_start;
+	area->size = new_size;
+	return 0;
+}
+
+int ccontrol_truncate (struct ccontrol_area * area, size_t size) {
+	if (area == NULL || area->start == NULL || size > area->size || size % area->module_info.block_size != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// release pages first (the module unmaps them), so that a failure leaves the mapping matching the area
+	size_t nb_pages = size / area->module_info.block_size;
+	if (ioctl (area->fd, CCONTROL_IO_TRUNCATE, &nb_pages) < 0) {
+		ERROR_AT ("area truncate");
+		return -1;
+	}
+
+	if (size == 0) {
+		if (munmap (area->start, area->size) < 0) {
+			ERROR_AT ("area munmap");
+			return -1;
+		}
+		area->start = NULL;
+	} else if (mremap (area->start, area->size, size, 0) == MAP_FAILED) {
+		ERROR_AT ("area mremap");
+		return -1;
+	}
+	area->size = size;
+	return 0;
+}
+
+/* Area recoloring
+ *
+ * Pages of the range are replaced in the module, the mapping is unchanged.
+ */
+
+int ccontrol_recolor (struct ccontrol_area * area, size_t offset, struct cc_layout * layout) {
+	if (area == NULL || layout == NULL || layout->color_list == NULL ||
+			layout->nb_colors < 1 || layout->color_repeat < 1 || layout->list_repeat < 1 ||
+			offset % area->module_info.block_size != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct cc_recolor recolor = { .offset = offset / area->module_info.block_size, .layout = *layout };
+	if (ioctl (area->fd, CCONTROL_IO_RECOLOR, &recolor) < 0) {
+		ERROR_AT ("area recolor");
+		return -1;
+	}
+	return 0;
+}
+
+/* Color query
+ *
+ * The module walks the page tables of the process, the range does not need to be an area.
+ */
+
+int ccontrol_query (struct ccontrol_area * area, const void * start, size_t size, int * colors, size_t * histogram, size_t * nb_present) {
+	size_t block_size = area != NULL ? area->module_info.block_size : 1;
+	if (area == NULL || (size_t) start % block_size != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct cc_query query = {
+		.start = (void *) start, .nb_pages = (size + block_size - 1) / block_size,
+		.colors = colors, .histogram = histogram, .nb_present = 0
+	};
+	if (ioctl (area->fd, CCONTROL_IO_QUERY, &query) < 0) {
+		ERROR_AT ("area query");
+		return -1;
+	}
+	if (nb_present != NULL)
+		*nb_present = query.nb_present;
+	return 0;
+}
+
 int ccontrol_destroy (struct ccontrol_area * area) {
 	if (area == NULL) {
 		errno = EINVAL;
@@ -17,11 +17,16 @@
  * Tighly coupled with its Linux kernel module (in case of errors,
  * check that the library and module are in sync).
  *
- * TODO: new steps, for reconfig ?
+ * Steps:
  * - create: open, ioctl-info
- * - set-size: ioctl-set-size (one shot)
- * - config-segment: ioctl-config-segment (layout, start, end)
+ * - claim (optional, before configure): ioctl-claim
+ * - configure: ioctl-config (or ioctl-config-segments for several layouts, ioctl-config-map for a color map), mmap
+ * - append / truncate (optional, any number of times): ioctl-append / ioctl-truncate, mremap
+ * - name (optional): ioctl-name ; a named area can be opened by name (open, ioctl-attach, mmap)
  * - destroy: close
+ *
+ * Any area handle can also query the colors of any memory of the process (ioctl-query, CAP_SYS_ADMIN unless
+ * the query_colors module param is set).
  */
 
 /**
@@ -40,6 +45,20 @@ struct ccontrol_area {
  */
 struct ccontrol_area * ccontrol_create (void);
 
+/**
+ * Color claim: join a group of areas (by name, or a private group if name is empty or NULL)
+ * and claim colors exclusively for it. Must be called before configure to charge the area to the group.
+ * Areas outside of the group cannot use claimed colors (EACCES), and colors used outside of the group
+ * (lazy layouts included, even before their pages are touched) cannot be claimed (EBUSY).
+ * Claiming colors needs CAP_SYS_ADMIN (EPERM), and a named group can only be joined by the user who created it (EACCES).
+ * @param colors Array of nb_colors colors to claim (may be NULL if nb_colors is 0).
+ * @param max_pages Maximum number of pages of each color held by areas of the group (EDQUOT), 0 to keep
+ * the current quota (none for a new group), CC_CLAIM_NO_QUOTA to remove it. Raising or removing a quota
+ * needs CAP_SYS_ADMIN (EPERM).
+ * @return 0 on success, -1 on error + errno.
+ */
+int ccontrol_claim (struct ccontrol_area * area, const char * group, int * colors, int nb_colors, size_t max_pages);
+
 /**
  * Area configuration
  * @param layout Layout description structure.
@@ -47,6 +66,83 @@ struct ccontrol_area * ccontrol_create (void);
  */
 int ccontrol_configure (struct ccontrol_area * area, struct cc_layout * layout);
 
+/**
+ * Multi-segment area configuration: one contiguous mapping made of several layouts, one after the other.
+ * Uses a single ioctl and a single mmap whatever the number of segments.
+ * @param layouts Array of nb_segments layout description structures (1 <= nb_segments <= CC_SEGMENTS_MAX).
+ * @param offsets If not NULL, array of nb_segments filled with the byte offset of each segment from area->start.
+ * @return 0 on success, -1 on error + errno.
+ */
+int ccontrol_configure_segments (struct ccontrol_area * area, struct cc_layout * layouts, int nb_segments, size_t * offsets);
+
+/**
+ * Area configuration with an explicit color map (runs of pages of one color, in order).
+ * @param map Color map, with any number of runs.
+ * @return 0 on success, -1 on error + errno.
+ */
+int ccontrol_configure_map (struct ccontrol_area * area, struct cc_color_map * map);
+
+/**
+ * Area growth: add pages with a new layout at the end of a configured area.
+ * The mapping is extended with mremap and may move (area->start is updated).
+ * @param layout Layout description structure of the new pages.
+ * @return 0 on success, -1 on error + errno.
+ */
+int ccontrol_append (struct ccontrol_area * area, struct cc_layout * layout);
+
+/**
+ * Area shrinking: release the pages after the first size bytes.
+ * @param size New area size in bytes, multiple of module_info.block_size.
+ * @return 0 on success, -1 on error + errno.
+ */
+int ccontrol_truncate (struct ccontrol_area * area, size_t size);
+
+/**
+ * Area recoloring: move a range of the area to pages following a new layout.
+ * Content and virtual addresses are kept, pages are copied by the module.
+ * @param offset Start of range in bytes, multiple of module_info.block_size.
+ * @param layout Layout of the range (its size gives the range size).
+ * @return 0 on success, -1 on error + errno (EBUSY if a page of the range is pinned by pending I/O).
+ */
+int ccontrol_recolor (struct ccontrol_area * area, size_t offset, struct cc_layout * layout);
+
+/**
+ * Area naming: the area persists in the module (with its pages and content)
+ * after being destroyed by every process using it, until unlinked.
+ * The name belongs to the calling user.
+ * @param name Area name, shorter than CC_AREA_NAME_MAX, not already used.
+ * @param mode Read/write permission bits of the name for owner, group and others, as for a file (0 for 0600).
+ * @return 0 on success, -1 on error + errno.
+ */
+int ccontrol_name (struct ccontrol_area * area, const char * name, unsigned int mode);
+
+/**
+ * Named area opening: get a new handle on a named area, mapped if configured.
+ * Needs read and write permission on the name (EACCES otherwise).
+ * @return area on success, NULL on error + errno.
+ */
+struct ccontrol_area * ccontrol_open (const char * name);
+
+/**
+ * Named area unlinking: remove the name, the area is destroyed when no process uses it.
+ * Only the owner of the name can unlink it (EPERM otherwise).
+ * @return 0 on success, -1 on error + errno.
+ */
+int ccontrol_unlink (const char * name);
+
+/**
+ * Color query: get the colors of the pages of [start, start + size[ (any memory of the process, not only areas).
+ * Never touched memory is skipped (-1), it is not faulted in ; other pages missing from page tables
+ * (swapped out, file pages) may be read back to get their color.
+ * @param area Any area (only used to reach the module).
+ * @param start Range start, multiple of module_info.block_size.
+ * @param colors If not NULL, array of size / block_size filled with the color of each page (-1 if not present).
+ * @param histogram If not NULL, array of module_info.nb_colors filled with the number of present pages of each color.
+ * @param nb_present If not NULL, set to the number of present pages.
+ * @return 0 on success, -1 on error + errno (EPERM without CAP_SYS_ADMIN nor query_colors module param).
+ */
+int ccontrol_query (struct ccontrol_area * area, const void * start, size_t size, int * colors, size_t * histogram, size_t * nb_present);
+
 /** Destroys an area.
  * @param area An area.
  * @return 0 on success, -1 on error + errno.
@@ -18,10 +18,27 @@
 // misc
 #include <linux/kernel.h>
 #include <linux/types.h>
+#include <linux/bitops.h>
+#include <linux/log2.h>
+#include <linux/string.h>
 #include <linux/mutex.h>
 #include <linux/rwsem.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/radix-tree.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/smp.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
 // memory management
 #include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/cred.h>
+#include <linux/capability.h>
 #include <linux/slab.h>
 #include <asm/uaccess.h>
 #include <asm/page.h>
@@ -30,9 +47,15 @@
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
 
 #include "ccontrol_ioctl.h"
 
+#define CREATE_TRACE_POINTS
+#include "ccontrol_trace.h"
+
 /* ------------ Module params ---------------- */
 
 MODULE_AUTHOR("Swann Perarnau <swann.perarnau@imag.fr>");
@@ -46,9 +69,49 @@ MODULE_PARM_DESC(max_mem, "maximum amount of memory the module can use");
 static int nb_colors = 1;
 module_param(nb_colors, int, 0);
 MODULE_PARM_DESC(nb_colors, "number of colors");
+static char *color_fn = "modulo";
+module_param(color_fn, charp, 0);
+MODULE_PARM_DESC(color_fn, "color function: modulo (pfn % nb_colors), bits (see color_bits) or xor (see color_masks)");
+static int color_bits[2];
+static int nb_color_bits_args = 0;
+module_param_array(color_bits, int, &nb_color_bits_args, 0);
+MODULE_PARM_DESC(color_bits, "color_fn=bits: first physical address bit of the color, and number of color bits");
+#define CC_MAX_COLOR_MASKS 16
+static unsigned long color_masks[CC_MAX_COLOR_MASKS];
+static int nb_color_masks = 0;
+module_param_array(color_masks, ulong, &nb_color_masks, 0);
+MODULE_PARM_DESC(color_masks, "color_fn=xor: physical address masks ; color bit i is the parity of (address & color_masks[i])");
+static unsigned long bank_masks[CC_MAX_COLOR_MASKS];
+static int nb_bank_masks = 0;
+module_param_array(bank_masks, ulong, &nb_bank_masks, 0);
+MODULE_PARM_DESC(bank_masks, "DRAM bank physical address masks ; bank color bit i is the parity of (address & bank_masks[i])");
+static int nb_inner_colors = 0;
+module_param(nb_inner_colors, int, 0);
+MODULE_PARM_DESC(nb_inner_colors, "number of colors of an inner cache level (like L2), must divide the number of cache colors (0: no inner level)");
 static int color_list_size_max = 0;
 module_param(color_list_size_max, int, 0);
 MODULE_PARM_DESC(color_list_size_max, "maximum number of colors in config list");
+static int fault_around = 16;
+module_param(fault_around, int, 0);
+MODULE_PARM_DESC(fault_around, "number of pages mapped by a page fault");
+static int pcp_batch = 8;
+module_param(pcp_batch, int, 0);
+MODULE_PARM_DESC(pcp_batch, "number of pages per color moved between per-cpu caches and module storage (0 disables caches)");
+static int low_watermark = 0;
+module_param(low_watermark, int, 0);
+MODULE_PARM_DESC(low_watermark, "free pages per color below which storage is refilled in background (0 disables)");
+static int high_watermark = 0;
+module_param(high_watermark, int, 0);
+MODULE_PARM_DESC(high_watermark, "free pages per color up to which background refill goes (at least low_watermark)");
+static bool preallocate = false;
+module_param(preallocate, bool, 0);
+MODULE_PARM_DESC(preallocate, "allocate the whole max_mem budget at load time");
+static int idle_release = 0;
+module_param(idle_release, int, 0);
+MODULE_PARM_DESC(idle_release, "seconds without allocation after which free blocks are given back to the kernel (0 disables)");
+static bool query_colors = false;
+module_param(query_colors, bool, 0);
+MODULE_PARM_DESC(query_colors, "let any user query the colors of its pages (physical address bits), instead of CAP_SYS_ADMIN only");
 
 /* -------------- Types --------------------- */
 
@@ -63,28 +126,168 @@ struct page_storage {
 	size_t nb_pages;
 };
 
+/* List of free pages, linked through page->lru.
+ * Free pages in module storage are order-0 pages owned by the module (not on any kernel lru list),
+ * so their lru field is unused. Storage metadata is then one list head per color and node, whatever max_mem.
+ */
+struct page_list {
+	struct list_head pages;
+	size_t nb_pages;
+};
+
+/* Per-cpu cache of colored pages.
+ * Area configure and release use the cache of the current cpu first,
+ * and only take cc_mem.mutex to move pages by batches of pcp_batch pages.
+ * A task may migrate while using a cache: the mutex keeps it correct, only locality is lost.
+ * A cache only contains pages of the memory node of its cpu (cpu_to_mem).
+ */
+struct cc_pcp_cache {
+	struct mutex mutex; // protects the cache ; taken before cc_mem.mutex
+
+	/* Array of nb_colors lists of at most 2 * pcp_batch pages (kvmalloc'ed).
+	 */
+	struct page_list *pages_by_color;
+};
+
+/* Storage of free pages of one NUMA node.
+ * Pages are only stored in the pool of their node.
+ */
+struct cc_node_pool {
+	/* Lists of free pages of a given color (nb_colors lists).
+	 * This doesn't own the pages.
+	 */
+	struct page_list *pages_by_color;
+
+	/* Allocated blocks that have not been split by color (still physically contiguous).
+	 * They are split by color on demand, and blocks left whole can be given back to the kernel.
+	 * free_blocks shares the allocated_blocks buffer (capacity max_allocated_pages >> block_order).
+	 */
+	size_t nb_free_blocks;
+	struct page **free_blocks;
+
+	/* Pages given back by areas still hold user data, and must be zeroed before reuse.
+	 * They wait in dirty lists (per color, and whole blocks linked through their first page)
+	 * until zero_work cleans them. Only clean pages are in pages_by_color and free_blocks.
+	 * Dirty pages count as free pages of their block.
+	 */
+	struct page_list *dirty_by_color;
+	struct page_list dirty_blocks;
+
+	/* Colors that went below low_watermark, refilled in background up to high_watermark
+	 * (bitmap of nb_colors bits, in the pools buffer).
+	 */
+	unsigned long *refill_colors;
+};
+
+/* Color function.
+ * Plain modulo if nb_masks == 0.
+ * Otherwise bit i of a color is the parity of (pfn & pfn_masks[i]), and nb_colors == 1 << nb_masks.
+ * The bits function is a special case with one bit per mask.
+ *
+ * With DRAM bank coloring, a color is the pair (cache color, bank color) numbered as
+ * cache_color * nb_bank_colors + bank_color: bank masks are the low masks, cache masks the high ones.
+ */
+struct ccontrol_colors {
+	int nb_masks;
+	unsigned long pfn_masks[CC_MAX_COLOR_MASKS];
+	int nb_cache_colors;
+	int nb_bank_colors;
+
+	/* Colors of an inner cache level (like L2) whose color bits are the low bits of the cache color.
+	 * Inner color of a color is cache_color % nb_inner_colors ; without inner level, nb_inner_colors == nb_cache_colors.
+	 */
+	int nb_inner_colors;
+};
+
 struct ccontrol_memory {
 	struct mutex mutex; // protects the module memory storage
 	
 	/* Kernel allocator for big buffers allocate slabs of 2^n pages (n is called order).
-	 * We chose a fixed block order that will be used to allocate pages from the kernel.
-	 * Its order is chosen so that is contains 1 or 2 pages of each color.
+	 * We chose a block order that will be used to allocate pages from the kernel.
+	 * Its order is chosen so that is contains a few pages of each color (see cc_colors_block_order),
+	 * but is clamped to the kernel max order: with many colors, a block then only contains some colors.
+	 *
+	 * When memory is fragmented, blocks of lower orders are allocated instead, down to min_order
+	 * (see cc_memory_new_block). They are always split by color (free_blocks, dirty_blocks and
+	 * cc_memory_is_block only deal with whole blocks of block_order).
 	 *
-	 * Up to nb_allocated_blocks can be allocated,
+	 * Up to max_allocated_pages pages can be allocated (max_mem),
 	 * using alloc_pages(HIGHMEM) to get contiguous phy memory.
+	 * Blocks are split into independent order-0 pages (split_page), and may come from a bigger allocation
+	 * (see cc_memory_preallocate) ; allocated_blocks stores the first page of each block.
 	 */
 	int block_order;
+	int min_order;
+	size_t nb_allocated_pages;
+	size_t max_allocated_pages;
 	size_t nb_allocated_blocks;
-	size_t max_allocated_blocks;
+	size_t max_allocated_blocks; // capacity of allocated_blocks (max_allocated_pages >> min_order)
 	struct page **allocated_blocks; // kvmalloc'ed
+	unsigned char *block_orders; // order of each block, indexed like allocated_blocks (in block_free_pages buffer)
 
-	/* Array to store struct page pointers to cached pages of a given color.
-	 * This doesn't own the pages.
-	 *
-	 * pages_by_color and all pages_by_color[c]->pages buffers are kvmalloc'ed
-	 * as one big buffer (can be quite big).
+	/* Number of pages of each block that are free in storage (colored stores or free_blocks),
+	 * indexed like allocated_blocks. Pages in per-cpu caches are not counted as free.
+	 * The index of the block of a page is stored in its private field.
+	 * Blocks with all pages free can be given back to the kernel (see cc_memory_release_blocks).
+	 */
+	unsigned int *block_free_pages; // kvmalloc'ed
+	size_t nb_free_whole_pages; // number of pages in blocks with all pages free
+
+	/* One pool per node (indexed by node id).
+	 * pools and all pages_by_color arrays are kvmalloc'ed as one buffer.
 	 */
-	struct page_storage *pages_by_color;
+	struct cc_node_pool *pools;
+
+	struct cc_pcp_cache __percpu *pcp; // NULL if per-cpu caches are disabled
+
+	/* Background refill: queued when a color of a node goes below low_watermark,
+	 * allocates blocks until every such color of the node reaches high_watermark (or max_mem is reached).
+	 * refill_nodes is the set of nodes to refill, refill_colors of pools the colors in demand.
+	 */
+	struct work_struct refill_work;
+	nodemask_t refill_nodes;
+
+	/* Release of free blocks: on kernel memory pressure (shrinker), and after idle_release seconds
+	 * without allocation (release_work, periodic). Both are disabled with preallocate.
+	 */
+	struct shrinker shrinker;
+	int shrinker_registered;
+	struct delayed_work release_work;
+	unsigned long last_use; // jiffies of the last page allocation
+
+	struct work_struct zero_work; // background zeroing of dirty pages (see cc_memory_zero_work)
+
+	/* Pages given back by areas while still referenced outside of the module (pinned by get_user_pages,
+	 * for direct I/O for instance). They are kept out of storage until the extra references are dropped,
+	 * so that pending I/O never reaches a page reused by another area. busy_work checks them periodically.
+	 */
+	struct page_list busy_pages;
+	struct delayed_work busy_work;
+};
+
+/* Module statistics, exported in debugfs (see cc_debugfs_create).
+ * Counters are updated without module locks.
+ */
+#define CC_STATS_LATENCY_BUCKETS 24 // bucket i counts durations in [2^(i-1), 2^i[ us (bucket 0: < 1us)
+
+struct ccontrol_stats {
+	atomic_long_t nb_refills; // blocks allocated from the kernel for storage (synchronous or background)
+	atomic_long_t refill_time_us; // total time of refill allocations
+	unsigned long refill_max_us; // racy max, only informative
+	atomic_long_t nb_max_mem_reached; // allocations refused because of max_mem
+	atomic_long_t nb_configures;
+	atomic_long_t nb_configure_errors;
+	atomic_long_t configure_latency[CC_STATS_LATENCY_BUCKETS]; // log2 histogram of configure time (us)
+	atomic_long_t nb_faults;
+
+	struct dentry *debugfs_dir;
+};
+
+/* Layout of a range of a lazy area (see CC_LAYOUT_LAZY): the color of a page is computed from it at first touch. */
+struct cc_lazy_range {
+	size_t first; // first page offset of the range in the area
+	size_t nb_pages;
+	struct cc_layout config; // contains color_list:kmalloc'ed (own copy)
 };
 
 struct memory_area {
@@ -95,15 +298,93 @@ struct memory_area {
 	 *
 	 * It is initially non configured, and cannot be mmaped.
 	 * An ioctl config must be performed to configure its layout and allow mmap.
+	 * It can then grow (append) or shrink (truncate) while mapped.
+	 *
+	 * Areas are reference counted: each file using the area has a reference, and a named area
+	 * has one more reference for its name. A named area thus survives its creator, and can be
+	 * attached by other files (and processes) until its name is unlinked.
 	 */
-	struct cc_layout config; // contains color_list:kmalloc'ed
-	struct page_storage store; // nb_pages==0 <=> pages==NULL ; contains pages:vmalloc'ed
+	struct cc_layout config; // first layout ; contains color_list:kmalloc'ed
+	struct page_storage store; // pages==NULL if nb_pages==0 or lazy ; contains pages:vmalloc'ed
 	int is_configured;
 	int vma_count;
+
+	/* A lazy area (configured with CC_LAYOUT_LAZY) has no page array, so that configure does not depend
+	 * on its size: pages taken at first touch are kept by page offset in lazy_pages, and their colors
+	 * come from the layout ranges. Every layout of a lazy area is lazy.
+	 */
+	int is_lazy;
+	struct cc_lazy_range *lazy_ranges; // by increasing offset, covering the area ; kmalloc'ed
+	int nb_lazy_ranges;
+	struct radix_tree_root lazy_pages;
+	spinlock_t lazy_lock; // serializes lazy_pages updates (faults only hold area_read)
+
+	/* Each area has its own address_space (used as filp->f_mapping) instead of the shared device inode one.
+	 * It tracks the vmas mapping this area only, so that truncate can unmap pages with unmap_mapping_range.
+	 */
+	struct address_space mapping;
+
+	struct cc_group *group; // group charged for the area pages (NULL if none) ; set at configure
+
+	struct kref ref; // put with cc_memory_put_area
+	struct list_head list; // in cc_areas.list
+	char name[CC_AREA_NAME_MAX]; // empty if unnamed ; protected by cc_areas.mutex
+	kuid_t uid; // owner of the name (fsuid of the naming process), with gid and mode ; protected by cc_areas.mutex
+	kgid_t gid;
+	umode_t mode;
+};
+
+/* All live areas.
+ * References of areas are only taken and put with mutex held, so that lookups by name do not race
+ * with the destruction of the last reference.
+ */
+struct ccontrol_areas {
+	struct mutex mutex; // protects list, names and area references ; taken before area locks
+	struct list_head list;
+};
+
+/* Group of files sharing color claims and quota (see struct cc_claim).
+ * Groups are reference counted by the files of the group and the areas charged to it.
+ */
+struct cc_group {
+	struct kref ref; // put with cc_claims_put_group
+	struct list_head list; // in cc_claims.groups
+	char name[CC_AREA_NAME_MAX]; // empty for a group private to one file
+	kuid_t uid; // creator (fsuid), only files of the same user (or CAP_SYS_ADMIN) can join
+	size_t max_pages; // per color quota (0 if none)
+	size_t *nb_pages; // pages of each color held by areas of the group (kvmalloc'ed)
+	size_t *nb_lazy; // lazy layouts using each color in areas of the group (kvmalloc'ed)
+};
+
+/* Color claims and page charges.
+ * Every page of an area is charged to its color (and to the group of the area) while the area holds it.
+ * Pages are charged after being taken from storage, and given back if the charge fails.
+ * Lazy layouts also reserve the colors they use (nb_lazy, once per layout, outside quotas), so that
+ * these colors cannot be claimed by another group before their pages are touched.
+ */
+struct ccontrol_claims {
+	struct mutex mutex; // protects groups, owners and charges ; taken after area locks, never with pcp caches or cc_mem
+	struct list_head groups;
+	struct cc_group **owners; // group claiming each color, NULL if not claimed (kvmalloc'ed)
+	size_t *nb_pages; // pages of each color held by all areas (kvmalloc'ed)
+	size_t *nb_lazy; // lazy layouts using each color in all areas (kvmalloc'ed)
+};
+
+/* Data of an open file of the device.
+ * A file uses the area created at open, or a named area after attach.
+ */
+struct cc_file {
+	struct memory_area *area; // area used by file operations
+	struct memory_area *created; // area created at open, kept until release (concurrent ioctls may use it)
+	struct cc_group *group; // group joined by claim (NULL if none) ; protected by cc_claims.mutex
 };
 
 static struct ccontrol_device cc_dev;
+static struct ccontrol_colors cc_colors;
 static struct ccontrol_memory cc_mem;
+static struct ccontrol_areas cc_areas;
+static struct ccontrol_claims cc_claims;
+static struct ccontrol_stats cc_stats;
 
 /* ---------------- Utils --------------------- */
 
@@ -133,60 +414,345 @@ static void* cc_kvmalloc(size_t size)
 		return kmalloc(size, GFP_KERNEL);
 }
 
-/* -------------- Memory --------------------- */
+/* -------------- Statistics ----------------- */
+
+static void cc_stats_refill(ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	atomic_long_inc(&cc_stats.nb_refills);
+	atomic_long_add(us, &cc_stats.refill_time_us);
+	if (us > cc_stats.refill_max_us)
+		cc_stats.refill_max_us = us;
+}
+
+static void cc_stats_configure(ktime_t start, int err)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	int bucket = us > 0 ? min_t(int, ilog2(us) + 1, CC_STATS_LATENCY_BUCKETS - 1) : 0;
+	atomic_long_inc(&cc_stats.nb_configures);
+	if (err)
+		atomic_long_inc(&cc_stats.nb_configure_errors);
+	else
+		atomic_long_inc(&cc_stats.configure_latency[bucket]);
+}
 
-/* We assume that the cache use a simple modulo mapping from physical addresses to cache lines.
+/* -------------- Colors --------------------- */
+
+/* By default, we assume that the cache use a simple modulo mapping from physical addresses to cache lines.
  * Thus the color of a physical page (pfn : phy page number) is a simple modulo.
+ *
+ * Caches indexed by a hash of address bits (like sliced last level caches) use masks:
+ * each color bit is the xor of some physical address bits.
+ * Only address bits above the page offset can be controlled by page coloring.
  */
 static int pfn_to_color(unsigned long pfn)
 {
-	return pfn % nb_colors;
+	int i, color = 0;
+	if (cc_colors.nb_masks == 0)
+		return pfn % nb_colors;
+	for (i = 0; i < cc_colors.nb_masks; ++i)
+		color |= (hweight_long(pfn & cc_colors.pfn_masks[i]) & 1) << i;
+	return color;
+}
+
+// Rank of color masks restricted to pfn bits (GF(2) gaussian elimination)
+static int cc_colors_rank(unsigned long pfn_bits)
+{
+	unsigned long rows[CC_MAX_COLOR_MASKS];
+	int i, j, rank = 0;
+	for (i = 0; i < cc_colors.nb_masks; ++i)
+		rows[i] = cc_colors.pfn_masks[i] & pfn_bits;
+	for (i = 0; i < cc_colors.nb_masks; ++i) {
+		unsigned long pivot = rows[i] & -rows[i]; // lowest bit
+		if (pivot == 0)
+			continue;
+		rank++;
+		for (j = i + 1; j < cc_colors.nb_masks; ++j)
+			if (rows[j] & pivot)
+				rows[j] ^= rows[i];
+	}
+	return rank;
+}
+
+/* Block order: smallest order such that every aligned block has the same number of pages of each color.
+ * For masks, it is when masks restricted to the pfn bits inside a block are linearly independent:
+ * the color is then a surjective linear map of the page index in block (xored with a per block constant).
+ * Returns -EINVAL if no block order works (masks are not independent).
+ */
+static int cc_colors_block_order(void)
+{
+	int order;
+	if (cc_colors.nb_masks == 0)
+		return get_order(nb_colors * PAGE_SIZE);
+	for (order = cc_colors.nb_masks; order < BITS_PER_LONG; ++order)
+		if (cc_colors_rank((1UL << order) - 1) == cc_colors.nb_masks)
+			return order;
+	return -EINVAL;
+}
+
+/* Add bank masks below the cache masks (bank color is the low part of the color).
+ * Requires a linear cache color function, so a modulo is converted to masks (power of 2 only).
+ */
+// locks: nothing (module init only)
+static int cc_colors_add_banks(void)
+{
+	int i;
+	if (cc_colors.nb_masks == 0) {
+		if (!is_power_of_2(nb_colors)) {
+			printk(KERN_ERR "ccontrol: bank coloring needs a power of 2 number of cache colors (%d)\n", nb_colors);
+			return -EINVAL;
+		}
+		cc_colors.nb_masks = ilog2(nb_colors);
+		for (i = 0; i < cc_colors.nb_masks; ++i)
+			cc_colors.pfn_masks[i] = 1UL << i;
+	}
+	if (cc_colors.nb_masks + nb_bank_masks > CC_MAX_COLOR_MASKS) {
+		printk(KERN_ERR "ccontrol: too many color and bank masks (max %d)\n", CC_MAX_COLOR_MASKS);
+		return -EINVAL;
+	}
+	// move cache masks up
+	for (i = cc_colors.nb_masks - 1; i >= 0; --i)
+		cc_colors.pfn_masks[i + nb_bank_masks] = cc_colors.pfn_masks[i];
+	for (i = 0; i < nb_bank_masks; ++i) {
+		if (bank_masks[i] & ~PAGE_MASK)
+			printk(KERN_WARNING "ccontrol: bank_masks[%d]=0x%lx: bits of the page offset are ignored\n",
+					i, bank_masks[i]);
+		cc_colors.pfn_masks[i] = bank_masks[i] >> PAGE_SHIFT;
+	}
+	cc_colors.nb_masks += nb_bank_masks;
+	cc_colors.nb_bank_colors = 1 << nb_bank_masks;
+	nb_colors = 1 << cc_colors.nb_masks;
+	return 0;
+}
+
+/* Inner cache levels (like L2) are indexed by the low physical address bits, without hash.
+ * Inner colors are only valid if the inner color of a page is its cache color % nb_inner_colors,
+ * that is if the low cache color bits are the low pfn bits (always true for modulo).
+ * Checked on cache masks only: bank masks are added below them later, and do not change the cache color.
+ */
+static int cc_colors_inner_is_modulo(void)
+{
+	int i;
+	if (cc_colors.nb_masks == 0)
+		return 1;
+	if (!is_power_of_2(cc_colors.nb_inner_colors))
+		return 0;
+	for (i = 0; i < ilog2(cc_colors.nb_inner_colors); ++i)
+		if (cc_colors.pfn_masks[i] != 1UL << i)
+			return 0;
+	return 1;
+}
+
+// locks: nothing (module init only)
+static int cc_colors_init(void)
+{
+	int i;
+	if (strcmp(color_fn, "modulo") == 0) {
+		cc_colors.nb_masks = 0;
+	} else if (strcmp(color_fn, "bits") == 0) {
+		if (nb_color_bits_args != 2 || color_bits[0] < PAGE_SHIFT ||
+				color_bits[1] < 1 || color_bits[1] > CC_MAX_COLOR_MASKS ||
+				color_bits[0] + color_bits[1] > BITS_PER_LONG) {
+			printk(KERN_ERR "ccontrol: color_bits must be \"<first bit >= %d>,<nb bits in [1,%d]>\"\n",
+					PAGE_SHIFT, CC_MAX_COLOR_MASKS);
+			return -EINVAL;
+		}
+		cc_colors.nb_masks = color_bits[1];
+		for (i = 0; i < cc_colors.nb_masks; ++i)
+			cc_colors.pfn_masks[i] = 1UL << (color_bits[0] - PAGE_SHIFT + i);
+	} else if (strcmp(color_fn, "xor") == 0) {
+		if (nb_color_masks < 1) {
+			printk(KERN_ERR "ccontrol: color_fn=xor requires color_masks\n");
+			return -EINVAL;
+		}
+		cc_colors.nb_masks = nb_color_masks;
+		for (i = 0; i < cc_colors.nb_masks; ++i) {
+			if (color_masks[i] & ~PAGE_MASK)
+				printk(KERN_WARNING "ccontrol: color_masks[%d]=0x%lx: bits of the page offset are ignored\n",
+						i, color_masks[i]);
+			cc_colors.pfn_masks[i] = color_masks[i] >> PAGE_SHIFT;
+		}
+	} else {
+		printk(KERN_ERR "ccontrol: unknown color function \"%s\"\n", color_fn);
+		return -EINVAL;
+	}
+
+	if (cc_colors.nb_masks > 0) {
+		// number of colors is given by masks
+		if (nb_colors != 1 && nb_colors != 1 << cc_colors.nb_masks) {
+			printk(KERN_ERR "ccontrol: nb_colors=%d does not match %d color masks\n", nb_colors, cc_colors.nb_masks);
+			return -EINVAL;
+		}
+		nb_colors = 1 << cc_colors.nb_masks;
+	}
+	cc_colors.nb_cache_colors = nb_colors;
+	cc_colors.nb_bank_colors = 1;
+
+	cc_colors.nb_inner_colors = nb_inner_colors > 0 ? nb_inner_colors : cc_colors.nb_cache_colors;
+	if (cc_colors.nb_cache_colors % cc_colors.nb_inner_colors != 0) {
+		printk(KERN_ERR "ccontrol: inner colors (%d) do not nest in cache colors (%d)\n",
+				cc_colors.nb_inner_colors, cc_colors.nb_cache_colors);
+		return -EINVAL;
+	}
+	if (cc_colors.nb_inner_colors != cc_colors.nb_cache_colors && !cc_colors_inner_is_modulo()) {
+		printk(KERN_ERR "ccontrol: inner colors (%d) need cache colors whose low bits are the low pfn bits "
+				"(color_fn=modulo, or first color bit %d)\n", cc_colors.nb_inner_colors, PAGE_SHIFT);
+		return -EINVAL;
+	}
+
+	if (nb_bank_masks > 0)
+		return cc_colors_add_banks();
+	return 0;
+}
+
+// Number of colors with the same inner color
+static int cc_colors_nb_nested(void)
+{
+	return nb_colors / cc_colors.nb_inner_colors;
+}
+
+// i-th color (i < cc_colors_nb_nested()) with the given inner color (bank color varies first)
+static int cc_colors_nested(int inner_color, int i)
+{
+	int nb_bank = cc_colors.nb_bank_colors;
+	return (inner_color + (i / nb_bank) * cc_colors.nb_inner_colors) * nb_bank + i % nb_bank;
 }
 
+/* -------------- Memory --------------------- */
+
+static int cc_pcp_init(void);
+static void cc_pcp_destroy(void);
+static void cc_memory_refill_work(struct work_struct *work);
+static int cc_memory_preallocate(void);
+static void cc_memory_free_blocks(void);
+static void cc_memory_release_work(struct work_struct *work);
+static void cc_memory_shrinker_init(struct shrinker *shrinker);
+static void cc_memory_zero_work(struct work_struct *work);
+static void cc_memory_busy_work(struct work_struct *work);
+
 static int cc_memory_init(size_t max_memory)
 {
 	int err = 0;
-	int c;
+	int c, nid;
 	char * buffer;
 
 	size_t sz_block;
+	size_t max_whole_blocks;
 	size_t sz_allocated_blocks;
+	size_t sz_pools_array;
 	size_t sz_pages_by_color_array;
-	size_t sz_colored_page_storage_by_array;
+	size_t sz_refill_colors;
 	size_t sz_colored_page_storage_total;
 
 	// mutex for concurrent access
 	mutex_init(&cc_mem.mutex);
 
 	// block subsystem init
-	cc_mem.block_order = get_order(nb_colors * PAGE_SIZE);
+	cc_mem.block_order = cc_colors_block_order();
+	if (cc_mem.block_order < 0) {
+		printk(KERN_ERR "ccontrol: memory: color and bank masks are not linearly independent\n");
+		err = -EINVAL;
+		goto err_block_list_alloc;
+	}
+	if (cc_mem.block_order >= MAX_ORDER) {
+		printk(KERN_WARNING "ccontrol: memory: block order %d needed by colors is above kernel max order, "
+				"blocks will only contain some colors\n", cc_mem.block_order);
+		cc_mem.block_order = MAX_ORDER - 1;
+	}
+	// lower orders are not costly for the kernel allocator (it retries hard)
+	cc_mem.min_order = min(cc_mem.block_order, PAGE_ALLOC_COSTLY_ORDER);
 	sz_block = PAGE_SIZE << cc_mem.block_order;
+	max_whole_blocks = DIV_ROUND_UP(max_memory, sz_block);
+	cc_mem.nb_allocated_pages = 0;
+	cc_mem.max_allocated_pages = max_whole_blocks << cc_mem.block_order;
 	cc_mem.nb_allocated_blocks = 0;
-	cc_mem.max_allocated_blocks = DIV_ROUND_UP(max_memory, sz_block);
-	sz_allocated_blocks = cc_mem.max_allocated_blocks * sizeof(struct page *);
+	cc_mem.max_allocated_blocks = cc_mem.max_allocated_pages >> cc_mem.min_order;
+	// allocated blocks list, followed by the free block list of each node
+	sz_allocated_blocks = (cc_mem.max_allocated_blocks + nr_node_ids * max_whole_blocks) * sizeof(struct page *);
 	cc_mem.allocated_blocks = cc_kvmalloc(sz_allocated_blocks);
 	if (cc_mem.allocated_blocks == NULL) {
 		err = -ENOMEM;
 		goto err_block_list_alloc;
 	}
+	// free page counts, followed by block orders
+	cc_mem.block_free_pages = cc_kvmalloc(cc_mem.max_allocated_blocks * (sizeof(unsigned int) + sizeof(unsigned char)));
+	if (cc_mem.block_free_pages == NULL) {
+		err = -ENOMEM;
+		goto err_block_free_pages_alloc;
+	}
+	cc_mem.block_orders = (unsigned char *) &cc_mem.block_free_pages[cc_mem.max_allocated_blocks];
+	cc_mem.nb_free_whole_pages = 0;
 
-	// init pages_by_color storage (uses one big vmalloc buffer cut into pieces)
-	sz_pages_by_color_array = nb_colors * sizeof(struct page_storage);
-	sz_colored_page_storage_by_array = 2 * cc_mem.max_allocated_blocks * sizeof(struct page *);
-	sz_colored_page_storage_total = sz_pages_by_color_array + nb_colors * sz_colored_page_storage_by_array;
+	// init node pools, pages_by_color and dirty_by_color lists, refill_colors (uses one vmalloc buffer cut into pieces)
+	sz_pools_array = nr_node_ids * sizeof(struct cc_node_pool);
+	sz_pages_by_color_array = nb_colors * sizeof(struct page_list);
+	sz_refill_colors = BITS_TO_LONGS(nb_colors) * sizeof(unsigned long);
+	sz_colored_page_storage_total = sz_pools_array + nr_node_ids * (2 * sz_pages_by_color_array + sz_refill_colors);
 
 	buffer = cc_kvmalloc(sz_colored_page_storage_total);
 	if (buffer == NULL) {
 		err = -ENOMEM;
 		goto err_pages_by_color_alloc;
 	}
-	cc_mem.pages_by_color = (struct page_storage *) buffer;
-	buffer += sz_pages_by_color_array;
-	for (c = 0; c < nb_colors; ++c) {
-		struct page_storage *store = &cc_mem.pages_by_color[c];
-		store->nb_pages = 0;
-		store->pages = (struct page **) buffer;
-		buffer += sz_colored_page_storage_by_array;
+	cc_mem.pools = (struct cc_node_pool *) buffer;
+	buffer += sz_pools_array;
+	for (nid = 0; nid < nr_node_ids; ++nid) {
+		struct cc_node_pool *pool = &cc_mem.pools[nid];
+		pool->nb_free_blocks = 0;
+		pool->free_blocks = cc_mem.allocated_blocks + cc_mem.max_allocated_blocks + nid * max_whole_blocks;
+		pool->pages_by_color = (struct page_list *) buffer;
+		buffer += sz_pages_by_color_array;
+		pool->dirty_by_color = (struct page_list *) buffer;
+		buffer += sz_pages_by_color_array;
+		pool->refill_colors = (unsigned long *) buffer;
+		buffer += sz_refill_colors;
+		bitmap_fill(pool->refill_colors, nb_colors); // initial refill (if enabled) warms every color
+		for (c = 0; c < nb_colors; ++c) {
+			INIT_LIST_HEAD(&pool->pages_by_color[c].pages);
+			pool->pages_by_color[c].nb_pages = 0;
+			INIT_LIST_HEAD(&pool->dirty_by_color[c].pages);
+			pool->dirty_by_color[c].nb_pages = 0;
+		}
+		INIT_LIST_HEAD(&pool->dirty_blocks.pages);
+		pool->dirty_blocks.nb_pages = 0;
+	}
+
+	err = cc_pcp_init();
+	if (err)
+		goto err_pcp_init;
+
+	if (preallocate) {
+		err = cc_memory_preallocate();
+		if (err) {
+			printk(KERN_ERR "ccontrol: memory: preallocation failed after %zu/%zu pages\n",
+					cc_mem.nb_allocated_pages, cc_mem.max_allocated_pages);
+			goto err_preallocate;
+		}
+	}
+
+	// start with a warm storage on every node if background refill is enabled
+	INIT_WORK(&cc_mem.refill_work, cc_memory_refill_work);
+	cc_mem.refill_nodes = node_states[N_MEMORY];
+	if (low_watermark > 0)
+		queue_work(system_unbound_wq, &cc_mem.refill_work);
+
+	INIT_WORK(&cc_mem.zero_work, cc_memory_zero_work);
+	INIT_LIST_HEAD(&cc_mem.busy_pages.pages);
+	cc_mem.busy_pages.nb_pages = 0;
+	INIT_DELAYED_WORK(&cc_mem.busy_work, cc_memory_busy_work);
+
+	// release of free blocks (a preallocated budget is kept)
+	INIT_DELAYED_WORK(&cc_mem.release_work, cc_memory_release_work);
+	cc_mem.last_use = jiffies;
+	cc_mem.shrinker_registered = 0;
+	if (!preallocate) {
+		cc_memory_shrinker_init(&cc_mem.shrinker);
+		if (register_shrinker(&cc_mem.shrinker) == 0)
+			cc_mem.shrinker_registered = 1;
+		else
+			printk(KERN_WARNING "ccontrol: memory: unable to register shrinker\n");
+		if (idle_release > 0)
+			queue_delayed_work(system_unbound_wq, &cc_mem.release_work, idle_release * HZ);
 	}
 
 	// print some structure size info
@@ -194,7 +760,8 @@ static int cc_memory_init(size_t max_memory)
 		char sx;
 		size_t sz;
 		sz = pretty_size(&sx, sz_block);
-		printk(KERN_DEBUG "ccontrol: memory: block={page_order=%d, size=%zu%c}\n", cc_mem.block_order, sz, sx);
+		printk(KERN_DEBUG "ccontrol: memory: block={page_order=%d, min_order=%d, size=%zu%c}, nodes=%d\n",
+				cc_mem.block_order, cc_mem.min_order, sz, sx, nr_node_ids);
 		sz = pretty_size(&sx, sz_allocated_blocks);
 		printk(KERN_DEBUG "ccontrol: memory: allocated_block_storage=%zu%c\n", sz, sx);
 		sz = pretty_size(&sx, sz_colored_page_storage_total);
@@ -202,234 +769,2774 @@ static int cc_memory_init(size_t max_memory)
 	}
 	return 0;
 
+err_preallocate:
+	cc_memory_free_blocks();
+	cc_pcp_destroy();
+err_pcp_init:
+	kvfree(cc_mem.pools);
 err_pages_by_color_alloc:
+	kvfree(cc_mem.block_free_pages);
+err_block_free_pages_alloc:
 	kvfree(cc_mem.allocated_blocks);
 err_block_list_alloc:
 	return err;
 }
 
-static void cc_memory_destroy(void)
+// Give all pages of a block back to the kernel (blocks are made of independent pages, see split_page)
+static void cc_memory_free_block(struct page *block, int order)
+{
+	int i;
+	for (i = 0; i < 1 << order; ++i) {
+		struct page *p = nth_page(block, i);
+		set_page_private(p, 0);
+		__free_page(p);
+	}
+}
+
+// locks: nothing (module init/exit only)
+static void cc_memory_free_blocks(void)
 {
 	size_t i;
+	for (i = 0; i < cc_mem.nb_allocated_blocks; ++i)
+		cc_memory_free_block(cc_mem.allocated_blocks[i], cc_mem.block_orders[i]);
+	cc_mem.nb_allocated_blocks = 0;
+	cc_mem.nb_allocated_pages = 0;
+}
+
+static void cc_memory_destroy(void)
+{
 	{
 		char sx;
 		size_t sz;
-		sz = pretty_size(&sx, cc_mem.nb_allocated_blocks * (PAGE_SIZE << cc_mem.block_order));
+		sz = pretty_size(&sx, cc_mem.nb_allocated_pages * PAGE_SIZE);
 		printk(KERN_DEBUG "ccontrol: memory: used %zu blocks (total size=%zu%c)\n",
 				cc_mem.nb_allocated_blocks, sz, sx);
 	}
 
-	// just delete colored page storage ; pages will be freed from the block list
-	kvfree(cc_mem.pages_by_color);
-	for (i = 0; i < cc_mem.nb_allocated_blocks; ++i)
-		// free user pages from the block list (alloced with alloc_pages)
-		__free_pages(cc_mem.allocated_blocks[i], cc_mem.block_order);
-	kvfree(cc_mem.allocated_blocks);
+	cancel_work_sync(&cc_mem.refill_work);
+	cancel_delayed_work_sync(&cc_mem.busy_work); // queues zero_work
+	cancel_work_sync(&cc_mem.zero_work);
+	if (cc_mem.shrinker_registered)
+		unregister_shrinker(&cc_mem.shrinker);
+	cancel_delayed_work_sync(&cc_mem.release_work);
+
+	// just delete colored page storage ; pages will be freed from the block list
+	cc_pcp_destroy();
+	kvfree(cc_mem.pools);
+	// free user pages from the block list (alloced with alloc_pages)
+	cc_memory_free_blocks();
+	kvfree(cc_mem.block_free_pages);
+	kvfree(cc_mem.allocated_blocks);
+}
+
+/* All functions take pages from the pool of the given node, and put pages in the pool of their node.
+ *
+ * push: put page into store
+ * pop: get page from store (potentially allocate new ones if empty)
+ * pop_color_run: get nb_pages of a color from store (all or nothing)
+ * refill_storage: get  new page block from system and put it into store
+ * alloc_block: get a new page block from system
+ * add_block: record a block allocated with cc_memory_new_block (fails if max_mem is reached)
+ * split_block: put all pages of an unused block into store
+ * push_pages: put a page array into store (keeping whole blocks unsplit)
+ * push_dirty_pages: put a page array with user data into dirty lists (keeping whole blocks unsplit)
+ * clean_color: zero dirty pages of a color synchronously and put them into store
+ * pop_dirty_block: get a whole dirty block, zeroed synchronously
+ *
+ * locks: needs cc_mem ; clean_color and pop_dirty_block (so pop, pop_color_run and refill_storage)
+ * drop it while zeroing, callers must not rely on storage state across these calls.
+ */
+static void cc_memory_push_page(struct page *p);
+static int cc_memory_pop_page(struct page **p, int color, int node);
+static int cc_memory_pop_color_run(struct page **pages, size_t nb_pages, int color, int node);
+static int cc_memory_refill_storage(int node);
+static int cc_memory_alloc_block(struct page **block, int node);
+static int cc_memory_add_block(struct page *block, int order);
+static void cc_memory_split_block(struct page *block);
+static void cc_memory_push_pages(struct page **pages, size_t nb_pages);
+static void cc_memory_push_dirty_pages(struct page **pages, size_t nb_pages);
+static size_t cc_memory_clean_color(int color, int node, size_t max_nb_pages);
+static struct page *cc_memory_pop_dirty_block(int node);
+
+static struct page_list *cc_memory_store(int color, int node)
+{
+	return &cc_mem.pools[node].pages_by_color[color];
+}
+
+// Free page accounting: nb_pages pages of the block of p enter (> 0) or leave (< 0) the storage
+static void cc_memory_account(struct page *p, int nb_pages)
+{
+	unsigned int block_size = 1 << cc_mem.block_orders[page_private(p)];
+	unsigned int *free_pages = &cc_mem.block_free_pages[page_private(p)];
+	if (*free_pages == block_size)
+		cc_mem.nb_free_whole_pages -= block_size;
+	*free_pages += nb_pages;
+	if (*free_pages == block_size)
+		cc_mem.nb_free_whole_pages += block_size;
+}
+
+// Remove the first page of a page list
+static struct page *cc_page_list_pop(struct page_list *list)
+{
+	struct page *p = list_first_entry(&list->pages, struct page, lru);
+	list_del(&p->lru);
+	list->nb_pages--;
+	return p;
+}
+
+static void cc_page_list_push(struct page_list *list, struct page *p)
+{
+	list_add(&p->lru, &list->pages);
+	list->nb_pages++;
+}
+
+// Take nb_pages pages of a store
+static void cc_memory_take_pages(struct page **pages, struct page_list *store, size_t nb_pages)
+{
+	size_t i;
+	for (i = 0; i < nb_pages; ++i) {
+		pages[i] = cc_page_list_pop(store);
+		cc_memory_account(pages[i], -1);
+	}
+}
+
+// Move nb_pages pages of a store to another list (out of storage)
+static void cc_memory_take_list(struct page_list *list, struct page_list *store, size_t nb_pages)
+{
+	size_t i;
+	for (i = 0; i < nb_pages; ++i) {
+		struct page *p = cc_page_list_pop(store);
+		cc_memory_account(p, -1);
+		cc_page_list_push(list, p);
+	}
+}
+
+static void cc_memory_push_page(struct page *p)
+{
+	struct page_list *store = cc_memory_store(pfn_to_color(page_to_pfn(p)), page_to_nid(p));
+	cc_page_list_push(store, p);
+	cc_memory_account(p, 1);
+}
+
+static void cc_memory_push_free_block(struct page *block)
+{
+	struct cc_node_pool *pool = &cc_mem.pools[page_to_nid(block)];
+	pool->free_blocks[pool->nb_free_blocks++] = block;
+	cc_memory_account(block, 1 << cc_mem.block_order);
+}
+
+static struct page *cc_memory_pop_free_block(int node)
+{
+	struct cc_node_pool *pool = &cc_mem.pools[node];
+	struct page *block = pool->free_blocks[--pool->nb_free_blocks];
+	cc_memory_account(block, -(1 << cc_mem.block_order));
+	return block;
+}
+
+static int cc_memory_pop_page(struct page **p, int color, int node)
+{
+	return cc_memory_pop_color_run(p, 1, color, node);
+}
+
+static int cc_memory_pop_color_run(struct page **pages, size_t nb_pages, int color, int node)
+{
+	struct page_list *store = cc_memory_store(color, node);
+	size_t popped = 0;
+	while (popped < nb_pages) {
+		size_t n;
+		// clean pages first, then unsplit blocks, then dirty pages, then new blocks
+		if (store->nb_pages == 0 && cc_mem.pools[node].nb_free_blocks == 0)
+			cc_memory_clean_color(color, node, nb_pages - popped);
+		if (store->nb_pages == 0) {
+			int err = cc_memory_refill_storage(node);
+			if (err < 0) {
+				// put back pages popped so far
+				cc_memory_push_pages(pages, popped);
+				return err;
+			}
+		}
+		n = min(nb_pages - popped, store->nb_pages);
+		cc_memory_take_pages(&pages[popped], store, n);
+		popped += n;
+	}
+	if (store->nb_pages < low_watermark) {
+		__set_bit(color, cc_mem.pools[node].refill_colors);
+		node_set(node, cc_mem.refill_nodes);
+		queue_work(system_unbound_wq, &cc_mem.refill_work);
+	}
+	return 0;
+}
+
+static int cc_memory_refill_storage(int node)
+{
+	struct cc_node_pool *pool = &cc_mem.pools[node];
+	struct page *page;
+	ktime_t start = ktime_get();
+	int from_free_block = pool->nb_free_blocks > 0 || pool->dirty_blocks.nb_pages > 0;
+
+	// Prefer splitting an unused whole block (clean, or zeroed now) to allocating a new one
+	if (pool->nb_free_blocks > 0) {
+		page = cc_memory_pop_free_block(node);
+	} else if (from_free_block) {
+		page = cc_memory_pop_dirty_block(node);
+	} else {
+		int err = cc_memory_alloc_block(&page, node);
+		if (err) {
+			trace_ccontrol_refill(node, 0, 0, ktime_us_delta(ktime_get(), start), err);
+			return err;
+		}
+	}
+
+	cc_memory_split_block(page);
+	trace_ccontrol_refill(node, page_to_pfn(page), from_free_block, ktime_us_delta(ktime_get(), start), 0);
+	return 0;
+}
+
+/* Get a page block of the given order from the kernel, on the given node only.
+ * GPF_HIGHUSER is for userspace memory, in a big space.
+ * Pages are zeroed by the kernel, as pages in storage must be clean.
+ * The block is split into independent order-0 pages with their own refcount:
+ * vm_insert_page requires "individual" pages (or __GFP_COMP), and split pages can be regrouped
+ * in blocks of any smaller order.
+ * See https://lkml.org/lkml/2006/3/16/170
+ *
+ * locks: nothing (only calls the kernel allocator)
+ */
+static struct page *cc_memory_alloc_pages(gfp_t gfp, int order, int node)
+{
+	struct page *page = alloc_pages_node(node, GFP_HIGHUSER | __GFP_THISNODE | __GFP_ZERO | gfp, order);
+	if (page != NULL)
+		split_page(page, order);
+	return page;
+}
+
+// Highest block order that fits in the remaining max_mem budget (-1 if exhausted)
+static int cc_memory_budget_order(void)
+{
+	size_t remaining = cc_mem.max_allocated_pages - cc_mem.nb_allocated_pages;
+	int order = cc_mem.block_order;
+	while (order >= cc_mem.min_order && remaining < (size_t) 1 << order)
+		order--;
+	return order >= cc_mem.min_order ? order : -1;
+}
+
+/* Allocate a block of max_order, or of a lower order down to min_order if memory is fragmented.
+ * Only the last try may reclaim and compact hard.
+ *
+ * locks: nothing (only calls the kernel allocator)
+ */
+static struct page *cc_memory_new_block(int node, int max_order, int *order)
+{
+	ktime_t start = ktime_get();
+	int o;
+	for (o = max_order; o >= cc_mem.min_order; --o) {
+		struct page *block = cc_memory_alloc_pages(o > cc_mem.min_order ? __GFP_NOWARN | __GFP_NORETRY : 0, o, node);
+		if (block != NULL) {
+			cc_stats_refill(start);
+			*order = o;
+			return block;
+		}
+	}
+	return NULL;
+}
+
+// Record the block index in its pages
+static void cc_memory_set_block_index(struct page *block, size_t index, int order)
+{
+	int i;
+	for (i = 0; i < 1 << order; i++)
+		set_page_private(nth_page(block, i), index);
+}
+
+// New blocks have no free page (until split or pushed as free block)
+static int cc_memory_add_block(struct page *block, int order)
+{
+	size_t index = cc_mem.nb_allocated_blocks;
+	if (cc_mem.nb_allocated_pages + (1 << order) > cc_mem.max_allocated_pages)
+		return -ENOMEM;
+	cc_memory_set_block_index(block, index, order);
+	cc_mem.block_free_pages[index] = 0;
+	cc_mem.block_orders[index] = order;
+	cc_mem.allocated_blocks[index] = block;
+	cc_mem.nb_allocated_blocks++;
+	cc_mem.nb_allocated_pages += 1 << order;
+	return 0;
+}
+
+// Put all pages of a block in storage (pages of colors not in demand are kept for later)
+static void cc_memory_split_block(struct page *block)
+{
+	int i;
+	for (i = 0; i < 1 << cc_mem.block_orders[page_private(block)]; i++)
+		cc_memory_push_page(nth_page(block, i));
+}
+
+// The new block may be smaller than block_order (see cc_memory_new_block)
+static int cc_memory_alloc_block(struct page **block, int node)
+{
+	struct page *page;
+	int order = cc_memory_budget_order();
+	if (order < 0) {
+		printk(KERN_ERR "ccontrol: memory: reached max_mem limit\n");
+		atomic_long_inc(&cc_stats.nb_max_mem_reached);
+		return -ENOMEM;
+	}
+
+	page = cc_memory_new_block(node, order, &order);
+	if (page == NULL)
+		return -ENOMEM;
+
+	cc_memory_add_block(page, order);
+	*block = page;
+	return 0;
+}
+
+/* Only colors in demand (refill_colors) are refilled, satisfied colors are removed from the set.
+ *
+ * locks: needs cc_mem
+ */
+static int cc_memory_needs_refill(int node)
+{
+	struct cc_node_pool *pool = &cc_mem.pools[node];
+	int c;
+	if (cc_mem.nb_allocated_pages == cc_mem.max_allocated_pages)
+		return 0;
+	// dirty pages will be available after zeroing
+	for_each_set_bit(c, pool->refill_colors, nb_colors) {
+		if (cc_memory_store(c, node)->nb_pages + pool->dirty_by_color[c].nb_pages < high_watermark)
+			return 1;
+		__clear_bit(c, pool->refill_colors);
+	}
+	return 0;
+}
+
+/* Background refill of the next node in refill_nodes.
+ * Blocks are allocated without holding cc_mem, so that configure is not blocked by reclaim or compaction.
+ *
+ * locks: uses cc_mem
+ */
+static void cc_memory_refill_work(struct work_struct *work)
+{
+	while (1) {
+		struct page *block;
+		int node = NUMA_NO_NODE;
+		int order = -1;
+
+		mutex_lock(&cc_mem.mutex);
+		while (!nodes_empty(cc_mem.refill_nodes)) {
+			node = first_node(cc_mem.refill_nodes);
+			if (cc_memory_needs_refill(node))
+				break;
+			node_clear(node, cc_mem.refill_nodes);
+			node = NUMA_NO_NODE;
+		}
+		if (node != NUMA_NO_NODE)
+			order = cc_memory_budget_order();
+		mutex_unlock(&cc_mem.mutex);
+		if (node == NUMA_NO_NODE || order < 0)
+			break;
+
+		block = cc_memory_new_block(node, order, &order);
+		if (block == NULL) {
+			// no memory right now on this node, configure will fallback to synchronous refill
+			mutex_lock(&cc_mem.mutex);
+			node_clear(node, cc_mem.refill_nodes);
+			mutex_unlock(&cc_mem.mutex);
+			continue;
+		}
+
+		mutex_lock(&cc_mem.mutex);
+		if (cc_memory_add_block(block, order) == 0) {
+			cc_memory_split_block(block);
+			block = NULL;
+		}
+		mutex_unlock(&cc_mem.mutex);
+		if (block != NULL) {
+			// max_mem was reached concurrently
+			cc_memory_free_block(block, order);
+			break;
+		}
+		cond_resched();
+	}
+}
+
+/* Allocate max_nb_pages pages on a node, using the highest orders available first.
+ * Blocks are kept whole in free_blocks, and split by color on demand.
+ * If memory is too fragmented, smaller blocks (down to min_order) are split by color immediately.
+ * On failure, blocks allocated so far stay recorded in allocated_blocks.
+ *
+ * locks: nothing (module init only)
+ */
+static int cc_memory_preallocate_node(size_t max_nb_pages, int node)
+{
+	size_t nb_pages = 0;
+	int order = MAX_ORDER - 1;
+	while (nb_pages < max_nb_pages) {
+		size_t i;
+		struct page *page;
+		int block_order;
+		int budget_order = cc_memory_budget_order();
+
+		if (budget_order < 0)
+			break;
+		if (budget_order < cc_mem.block_order)
+			order = min(order, budget_order);
+
+		// do not reclaim hard for high orders, fallback to lower orders instead
+		page = cc_memory_alloc_pages(order > cc_mem.min_order ? __GFP_NOWARN | __GFP_NORETRY : 0, order, node);
+		if (page == NULL) {
+			if (order == cc_mem.min_order)
+				return -ENOMEM;
+			order--;
+			continue;
+		}
+
+		// cut into blocks, and give back the unneeded tail
+		block_order = min(order, cc_mem.block_order);
+		for (i = 0; i < (size_t) 1 << (order - block_order) && nb_pages < max_nb_pages; ++i) {
+			struct page *block = nth_page(page, i << block_order);
+			if (cc_memory_add_block(block, block_order))
+				break; // budget exhausted
+			if (block_order == cc_mem.block_order)
+				cc_memory_push_free_block(block);
+			else
+				cc_memory_split_block(block);
+			nb_pages += 1 << block_order;
+		}
+		for (i <<= block_order; i < (size_t) 1 << order; ++i)
+			__free_page(nth_page(page, i));
+		cond_resched();
+	}
+	return 0;
+}
+
+// Allocate the whole max_mem budget, evenly split between nodes with memory.
+static int cc_memory_preallocate(void)
+{
+	int node;
+	size_t nb_nodes = num_node_state(N_MEMORY);
+	for_each_node_state(node, N_MEMORY) {
+		size_t remaining = cc_mem.max_allocated_pages - cc_mem.nb_allocated_pages;
+		int err = cc_memory_preallocate_node(DIV_ROUND_UP(remaining, nb_nodes), node);
+		if (err)
+			return err;
+		nb_nodes--;
+	}
+	return 0;
+}
+
+/* Blocks are allocated with their natural alignment (buddy allocator).
+ * So pages[0..block_size[ is a whole block iff it starts on a block boundary, is physically contiguous,
+ * and the first page belongs to a block of block_order (not to a smaller fallback block).
+ */
+static int cc_memory_is_block(struct page **pages, size_t nb_pages)
+{
+	size_t i;
+	size_t block_size = 1 << cc_mem.block_order;
+	unsigned long pfn = page_to_pfn(pages[0]);
+	if (cc_mem.block_order == 0 || nb_pages < block_size || (pfn & (block_size - 1)) != 0)
+		return 0;
+	if (cc_mem.block_orders[page_private(pages[0])] != cc_mem.block_order)
+		return 0;
+	for (i = 1; i < block_size; ++i)
+		if (page_to_pfn(pages[i]) != pfn + i)
+			return 0;
+	return 1;
+}
+
+static void cc_memory_push_pages(struct page **pages, size_t nb_pages)
+{
+	size_t i = 0;
+	while (i < nb_pages) {
+		if (cc_memory_is_block(&pages[i], nb_pages - i)) {
+			cc_memory_push_free_block(pages[i]);
+			i += 1 << cc_mem.block_order;
+		} else {
+			cc_memory_push_page(pages[i]);
+			i++;
+		}
+	}
+}
+
+/* -------------- Page zeroing --------------- */
+
+/* Zero a page with non-temporal stores on x86-64 (movnti), so that zeroing
+ * does not evict the cache content of running applications. The sfence orders them before later stores.
+ * Other architectures use clear_highpage.
+ *
+ * locks: nothing
+ */
+static void cc_zero_page(struct page *page)
+{
+#ifdef CONFIG_X86_64
+	unsigned long *addr = kmap_atomic(page);
+	size_t i;
+	for (i = 0; i < PAGE_SIZE / sizeof(unsigned long); i += 4)
+		asm volatile("movnti %1, 0(%0)\n\t"
+				"movnti %1, 8(%0)\n\t"
+				"movnti %1, 16(%0)\n\t"
+				"movnti %1, 24(%0)\n\t"
+				: : "r" (&addr[i]), "r" (0UL) : "memory");
+	asm volatile("sfence" : : : "memory");
+	kunmap_atomic(addr);
+#else
+	clear_highpage(page);
+#endif
+}
+
+static void cc_zero_block(struct page *block)
+{
+	int i;
+	for (i = 0; i < 1 << cc_mem.block_order; i++)
+		cc_zero_page(nth_page(block, i));
+}
+
+/* Pages of areas have one reference from the module (and one per pte mapping them).
+ * Once unmapped, more references mean that the page is pinned (see busy_pages).
+ */
+static int cc_page_is_pinned(struct page *p)
+{
+	return page_count(p) > 1;
+}
+
+static int cc_memory_has_pinned(struct page **pages, size_t nb_pages)
+{
+	size_t i;
+	for (i = 0; i < nb_pages; ++i)
+		if (cc_page_is_pinned(pages[i]))
+			return 1;
+	return 0;
+}
+
+static void cc_memory_push_dirty_page(struct page *p)
+{
+	struct cc_node_pool *pool = &cc_mem.pools[page_to_nid(p)];
+	cc_page_list_push(&pool->dirty_by_color[pfn_to_color(page_to_pfn(p))], p);
+	cc_memory_account(p, 1);
+}
+
+// Pages must be unmapped. locks: needs cc_mem
+static void cc_memory_push_dirty_pages(struct page **pages, size_t nb_pages)
+{
+	size_t i = 0;
+	size_t block_size = 1 << cc_mem.block_order;
+	int has_busy = 0;
+	while (i < nb_pages) {
+		if (cc_page_is_pinned(pages[i])) {
+			cc_page_list_push(&cc_mem.busy_pages, pages[i]);
+			has_busy = 1;
+			i++;
+		} else if (cc_memory_is_block(&pages[i], nb_pages - i) && !cc_memory_has_pinned(&pages[i], block_size)) {
+			cc_page_list_push(&cc_mem.pools[page_to_nid(pages[i])].dirty_blocks, pages[i]);
+			cc_memory_account(pages[i], block_size);
+			i += block_size;
+		} else {
+			cc_memory_push_dirty_page(pages[i]);
+			i++;
+		}
+	}
+	if (nb_pages > 0)
+		queue_work(system_unbound_wq, &cc_mem.zero_work);
+	if (has_busy)
+		queue_delayed_work(system_unbound_wq, &cc_mem.busy_work, HZ);
+}
+
+/* Synchronous zeroing, when no clean page is left: pages are taken out of storage,
+ * and zeroed without holding cc_mem (as in cc_memory_zero_work).
+ * Returns the number of pages made available in store.
+ *
+ * locks: needs cc_mem (dropped while zeroing)
+ */
+static size_t cc_memory_clean_color(int color, int node, size_t max_nb_pages)
+{
+	struct page_list *dirty = &cc_mem.pools[node].dirty_by_color[color];
+	struct page_list cleaned;
+	size_t n = min(max_nb_pages, dirty->nb_pages);
+	struct page *p;
+
+	INIT_LIST_HEAD(&cleaned.pages);
+	cleaned.nb_pages = 0;
+	cc_memory_take_list(&cleaned, dirty, n);
+	mutex_unlock(&cc_mem.mutex);
+	list_for_each_entry(p, &cleaned.pages, lru)
+		cc_zero_page(p);
+	mutex_lock(&cc_mem.mutex);
+	while (cleaned.nb_pages > 0)
+		cc_memory_push_page(cc_page_list_pop(&cleaned));
+	return n;
+}
+
+// The block is out of storage. locks: needs cc_mem (dropped while zeroing)
+static struct page *cc_memory_pop_dirty_block(int node)
+{
+	struct page *block = cc_page_list_pop(&cc_mem.pools[node].dirty_blocks);
+	cc_memory_account(block, -(1 << cc_mem.block_order));
+	mutex_unlock(&cc_mem.mutex);
+	cc_zero_block(block);
+	mutex_lock(&cc_mem.mutex);
+	return block;
+}
+
+/* Give back pages of an area: they are zeroed in background before being reused.
+ * Dirty pages skip per-cpu caches, which only contain clean pages.
+ *
+ * Pages are sorted by color into local lists without holding cc_mem, by batches of about CC_RECYCLE_BATCH pages,
+ * and each list is spliced into the dirty list of its color in one operation.
+ * Only free page accounting is done page by page under the lock (struct pages are still in cache).
+ * Candidate whole blocks (aligned physically contiguous runs) and pages of other nodes than the first page
+ * of the batch are left in the pages array, and go through cc_memory_push_dirty_pages.
+ * The pages array is used as scratch space and its content is lost.
+ *
+ * locks: uses cc_mem
+ */
+#define CC_RECYCLE_BATCH 1024
+
+static int cc_memory_is_block_run(struct page **pages, size_t nb_pages)
+{
+	size_t i;
+	size_t block_size = 1 << cc_mem.block_order;
+	unsigned long pfn = page_to_pfn(pages[0]);
+	if (cc_mem.block_order == 0 || nb_pages < block_size || (pfn & (block_size - 1)) != 0)
+		return 0;
+	for (i = 1; i < block_size; ++i)
+		if (page_to_pfn(pages[i]) != pfn + i)
+			return 0;
+	return !cc_memory_has_pinned(pages, block_size);
+}
+
+static void cc_memory_recycle_pages(struct page **pages, size_t nb_pages)
+{
+	struct page_list *sorted;
+	struct page_list busy;
+	int *used;
+	size_t i = 0;
+	size_t block_size = 1 << cc_mem.block_order;
+	int c;
+
+	sorted = cc_kvmalloc(nb_colors * (sizeof(struct page_list) + sizeof(int)));
+	if (sorted == NULL) {
+		// page by page under the lock
+		mutex_lock(&cc_mem.mutex);
+		cc_memory_push_dirty_pages(pages, nb_pages);
+		mutex_unlock(&cc_mem.mutex);
+		return;
+	}
+	used = (int *) &sorted[nb_colors];
+	INIT_LIST_HEAD(&busy.pages);
+	busy.nb_pages = 0;
+	for (c = 0; c < nb_colors; ++c) {
+		INIT_LIST_HEAD(&sorted[c].pages);
+		sorted[c].nb_pages = 0;
+	}
+
+	while (i < nb_pages) {
+		size_t first = i, nb_left = 0;
+		int k, nb_used = 0, node = NUMA_NO_NODE;
+		struct page *p;
+
+		// sort a batch by color (pages are owned by the caller, their lru is unused)
+		while (i < nb_pages && i - first < CC_RECYCLE_BATCH) {
+			p = pages[i];
+			if (cc_page_is_pinned(p)) {
+				cc_page_list_push(&busy, p);
+				i++;
+			} else if (cc_memory_is_block_run(&pages[i], nb_pages - i)) {
+				memmove(&pages[first + nb_left], &pages[i], block_size * sizeof(struct page *));
+				nb_left += block_size;
+				i += block_size;
+			} else {
+				if (node == NUMA_NO_NODE)
+					node = page_to_nid(p);
+				if (page_to_nid(p) == node) {
+					c = pfn_to_color(page_to_pfn(p));
+					if (sorted[c].nb_pages == 0)
+						used[nb_used++] = c;
+					cc_page_list_push(&sorted[c], p);
+				} else {
+					pages[first + nb_left++] = p;
+				}
+				i++;
+			}
+		}
+
+		mutex_lock(&cc_mem.mutex);
+		cc_memory_push_dirty_pages(&pages[first], nb_left);
+		for (k = 0; k < nb_used; ++k) {
+			struct page_list *list = &sorted[used[k]];
+			struct page_list *dirty = &cc_mem.pools[node].dirty_by_color[used[k]];
+			list_for_each_entry(p, &list->pages, lru)
+				cc_memory_account(p, 1);
+			list_splice_init(&list->pages, &dirty->pages);
+			dirty->nb_pages += list->nb_pages;
+			list->nb_pages = 0;
+		}
+		if (busy.nb_pages > 0) {
+			list_splice_init(&busy.pages, &cc_mem.busy_pages.pages);
+			cc_mem.busy_pages.nb_pages += busy.nb_pages;
+			busy.nb_pages = 0;
+			queue_delayed_work(system_unbound_wq, &cc_mem.busy_work, HZ);
+		}
+		mutex_unlock(&cc_mem.mutex);
+		if (nb_used > 0)
+			queue_work(system_unbound_wq, &cc_mem.zero_work);
+		cond_resched();
+	}
+	kvfree(sorted);
+}
+
+/* Background zeroing of dirty pages.
+ * Pages are taken out of storage by batches of CC_ZERO_BATCH pages (or one block), zeroed without holding cc_mem,
+ * and put back in clean storage. Meanwhile they are neither available nor releasable.
+ *
+ * locks: uses cc_mem
+ */
+#define CC_ZERO_BATCH 32
+
+static void cc_memory_zero_work(struct work_struct *work)
+{
+	struct page *pages[CC_ZERO_BATCH];
+	int node, c;
+	size_t i, n;
+	for_each_node_state(node, N_MEMORY) {
+		struct cc_node_pool *pool = &cc_mem.pools[node];
+		while (1) {
+			struct page *block = NULL;
+			mutex_lock(&cc_mem.mutex);
+			if (pool->dirty_blocks.nb_pages > 0) {
+				block = cc_page_list_pop(&pool->dirty_blocks);
+				cc_memory_account(block, -(1 << cc_mem.block_order));
+			}
+			mutex_unlock(&cc_mem.mutex);
+			if (block == NULL)
+				break;
+			cc_zero_block(block);
+			mutex_lock(&cc_mem.mutex);
+			cc_memory_push_free_block(block);
+			mutex_unlock(&cc_mem.mutex);
+			cond_resched();
+		}
+		for (c = 0; c < nb_colors; ++c) {
+			struct page_list *dirty = &pool->dirty_by_color[c];
+			while (1) {
+				mutex_lock(&cc_mem.mutex);
+				n = min((size_t) CC_ZERO_BATCH, dirty->nb_pages);
+				cc_memory_take_pages(pages, dirty, n);
+				mutex_unlock(&cc_mem.mutex);
+				if (n == 0)
+					break;
+				for (i = 0; i < n; ++i)
+					cc_zero_page(pages[i]);
+				mutex_lock(&cc_mem.mutex);
+				for (i = 0; i < n; ++i)
+					cc_memory_push_page(pages[i]);
+				mutex_unlock(&cc_mem.mutex);
+				cond_resched();
+			}
+		}
+	}
+}
+
+/* Move busy pages that are no longer pinned to the dirty lists.
+ * Runs every second while some pages are busy.
+ *
+ * locks: uses cc_mem
+ */
+static void cc_memory_busy_work(struct work_struct *work)
+{
+	struct page *p, *next;
+	int nb_unpinned = 0;
+	size_t nb_busy;
+
+	mutex_lock(&cc_mem.mutex);
+	list_for_each_entry_safe(p, next, &cc_mem.busy_pages.pages, lru) {
+		if (!cc_page_is_pinned(p)) {
+			list_del(&p->lru);
+			cc_mem.busy_pages.nb_pages--;
+			cc_memory_push_dirty_page(p);
+			nb_unpinned++;
+		}
+	}
+	nb_busy = cc_mem.busy_pages.nb_pages;
+	mutex_unlock(&cc_mem.mutex);
+
+	if (nb_unpinned > 0)
+		queue_work(system_unbound_wq, &cc_mem.zero_work);
+	if (nb_busy > 0)
+		queue_delayed_work(system_unbound_wq, &cc_mem.busy_work, HZ);
+}
+
+/* -------------- Per-cpu caches --------------- */
+
+static int cc_pcp_init(void)
+{
+	int cpu;
+	size_t sz_pages_by_color_array = nb_colors * sizeof(struct page_list);
+
+	cc_mem.pcp = NULL;
+	if (pcp_batch <= 0)
+		return 0;
+
+	cc_mem.pcp = alloc_percpu(struct cc_pcp_cache);
+	if (cc_mem.pcp == NULL)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		struct cc_pcp_cache *pcp = per_cpu_ptr(cc_mem.pcp, cpu);
+		int c;
+		mutex_init(&pcp->mutex);
+		pcp->pages_by_color = cc_kvmalloc(sz_pages_by_color_array);
+		if (pcp->pages_by_color == NULL)
+			goto err_cache_alloc;
+		for (c = 0; c < nb_colors; ++c) {
+			INIT_LIST_HEAD(&pcp->pages_by_color[c].pages);
+			pcp->pages_by_color[c].nb_pages = 0;
+		}
+	}
+	return 0;
+
+err_cache_alloc:
+	cc_pcp_destroy();
+	return -ENOMEM;
+}
+
+// Pages in caches are not freed here, they are owned by the block list.
+static void cc_pcp_destroy(void)
+{
+	int cpu;
+	if (cc_mem.pcp == NULL)
+		return;
+	for_each_possible_cpu(cpu)
+		kvfree(per_cpu_ptr(cc_mem.pcp, cpu)->pages_by_color); // kvfree(NULL) is a no-op
+	free_percpu(cc_mem.pcp);
+	cc_mem.pcp = NULL;
+}
+
+static void cc_pcp_drain(int trylock);
+
+/* Get nb_pages of a color from a node, from the current cpu cache first (if on the same node),
+ * then from module storage.
+ * When storage is used, the cache is also refilled with up to pcp_batch pages.
+ * On error, no page is taken.
+ *
+ * locks: uses pcp cache, then cc_mem
+ */
+static int cc_pcp_try_pop_pages(struct page **pages, size_t nb_pages, int color, int node)
+{
+	int err = 0;
+	int cpu = raw_smp_processor_id();
+	struct cc_pcp_cache *pcp;
+	struct page_list *cache;
+	size_t i, n;
+
+	if (cc_mem.pcp == NULL || node != cpu_to_mem(cpu)) {
+		mutex_lock(&cc_mem.mutex);
+		err = cc_memory_pop_color_run(pages, nb_pages, color, node);
+		mutex_unlock(&cc_mem.mutex);
+		return err;
+	}
+
+	pcp = per_cpu_ptr(cc_mem.pcp, cpu);
+	mutex_lock(&pcp->mutex);
+	cache = &pcp->pages_by_color[color];
+
+	n = min(nb_pages, cache->nb_pages);
+	for (i = 0; i < n; ++i)
+		pages[i] = cc_page_list_pop(cache);
+
+	if (n < nb_pages) {
+		struct page_list *store = cc_memory_store(color, node);
+		mutex_lock(&cc_mem.mutex);
+		err = cc_memory_pop_color_run(&pages[n], nb_pages - n, color, node);
+		if (err == 0) {
+			// refill cache with already available pages only
+			size_t refill = min((size_t) pcp_batch, store->nb_pages);
+			cc_memory_take_list(cache, store, refill);
+		} else {
+			// give back the pages taken from cache
+			cc_memory_push_pages(pages, n);
+		}
+		mutex_unlock(&cc_mem.mutex);
+	}
+
+	mutex_unlock(&pcp->mutex);
+	return err;
+}
+
+/* As cc_pcp_try_pop_pages, but if storage is exhausted (near max_mem), free pages parked in the caches
+ * of other cpus are moved back to storage, and the pop is retried once.
+ *
+ * locks: uses pcp caches, then cc_mem
+ */
+static int cc_pcp_pop_pages(struct page **pages, size_t nb_pages, int color, int node)
+{
+	int err = cc_pcp_try_pop_pages(pages, nb_pages, color, node);
+	if (err == -ENOMEM && cc_mem.pcp != NULL) {
+		cc_pcp_drain(0);
+		err = cc_pcp_try_pop_pages(pages, nb_pages, color, node);
+	}
+	return err;
+}
+
+/* Give back pages, to the current cpu cache first, then to module storage.
+ * Whole blocks (see cc_memory_is_block) and pages from other nodes always go to module storage.
+ * The pages array is used as scratch space and its content is lost.
+ *
+ * locks: uses pcp cache, then cc_mem
+ */
+static void cc_pcp_push_pages(struct page **pages, size_t nb_pages)
+{
+	int cpu = raw_smp_processor_id();
+	int node = cpu_to_mem(cpu);
+	struct cc_pcp_cache *pcp;
+	size_t i = 0;
+	size_t nb_overflow = 0;
+
+	if (cc_mem.pcp == NULL) {
+		mutex_lock(&cc_mem.mutex);
+		cc_memory_push_pages(pages, nb_pages);
+		mutex_unlock(&cc_mem.mutex);
+		return;
+	}
+
+	pcp = per_cpu_ptr(cc_mem.pcp, cpu);
+	mutex_lock(&pcp->mutex);
+
+	// keep pages in cache while there is room, and pack the rest at the start of pages
+	while (i < nb_pages) {
+		if (cc_memory_is_block(&pages[i], nb_pages - i)) {
+			size_t block_size = 1 << cc_mem.block_order;
+			memmove(&pages[nb_overflow], &pages[i], block_size * sizeof(struct page *));
+			nb_overflow += block_size;
+			i += block_size;
+		} else {
+			struct page_list *cache = &pcp->pages_by_color[pfn_to_color(page_to_pfn(pages[i]))];
+			if (page_to_nid(pages[i]) == node && cache->nb_pages < 2 * pcp_batch)
+				cc_page_list_push(cache, pages[i]);
+			else
+				pages[nb_overflow++] = pages[i];
+			i++;
+		}
+	}
+
+	if (nb_overflow > 0) {
+		mutex_lock(&cc_mem.mutex);
+		cc_memory_push_pages(pages, nb_overflow);
+		mutex_unlock(&cc_mem.mutex);
+	}
+
+	mutex_unlock(&pcp->mutex);
+}
+
+/* Move all pages of per-cpu caches to module storage.
+ * With trylock, busy caches are skipped (and the drain may fail if cc_mem is busy).
+ *
+ * locks: uses pcp caches, then cc_mem
+ */
+static void cc_pcp_drain(int trylock)
+{
+	int cpu;
+	if (cc_mem.pcp == NULL)
+		return;
+	for_each_possible_cpu(cpu) {
+		struct cc_pcp_cache *pcp = per_cpu_ptr(cc_mem.pcp, cpu);
+		int c;
+		if (trylock) {
+			if (!mutex_trylock(&pcp->mutex))
+				continue;
+			if (!mutex_trylock(&cc_mem.mutex)) {
+				mutex_unlock(&pcp->mutex);
+				return;
+			}
+		} else {
+			mutex_lock(&pcp->mutex);
+			mutex_lock(&cc_mem.mutex);
+		}
+		for (c = 0; c < nb_colors; ++c) {
+			struct page_list *cache = &pcp->pages_by_color[c];
+			while (cache->nb_pages > 0)
+				cc_memory_push_page(cc_page_list_pop(cache));
+		}
+		mutex_unlock(&cc_mem.mutex);
+		mutex_unlock(&pcp->mutex);
+	}
+}
+
+/* -------------- Memory release --------------- */
+
+/* Blocks with all their pages free in storage are given back to the kernel.
+ * Whole free blocks are released first, as they are not mixed with other pages in colored stores.
+ * Split blocks are marked, then their pages are removed from colored stores in one pass.
+ * A released block is replaced by the last block of allocated_blocks (the index of its pages is updated).
+ */
+#define CC_BLOCK_RELEASED UINT_MAX // block_free_pages marker of blocks being released
+
+// Remove pages of blocks being released from a store
+static void cc_memory_store_remove_released(struct page_list *store)
+{
+	struct page *p, *next;
+	list_for_each_entry_safe(p, next, &store->pages, lru) {
+		if (cc_mem.block_free_pages[page_private(p)] == CC_BLOCK_RELEASED) {
+			list_del(&p->lru);
+			store->nb_pages--;
+		}
+	}
+}
+
+// Free a marked block, and move the last block at its index
+static void cc_memory_release_block(size_t index)
+{
+	size_t last = cc_mem.nb_allocated_blocks - 1;
+	int order = cc_mem.block_orders[index];
+	cc_memory_free_block(cc_mem.allocated_blocks[index], order);
+	cc_mem.nb_allocated_pages -= 1 << order;
+	if (index != last) {
+		cc_mem.allocated_blocks[index] = cc_mem.allocated_blocks[last];
+		cc_mem.block_free_pages[index] = cc_mem.block_free_pages[last];
+		cc_mem.block_orders[index] = cc_mem.block_orders[last];
+		cc_memory_set_block_index(cc_mem.allocated_blocks[index], index, cc_mem.block_orders[index]);
+	}
+	cc_mem.nb_allocated_blocks--;
+}
+
+/* Release blocks with all pages free, until max_nb_pages pages are released.
+ * Returns the number of released pages.
+ *
+ * locks: needs cc_mem
+ */
+static size_t cc_memory_release_blocks(size_t max_nb_pages)
+{
+	size_t i, nb_marked = 0, nb_marked_blocks = 0, nb_released = 0;
+	int node, c;
+
+	// whole free blocks
+	for_each_node_state(node, N_MEMORY) {
+		struct cc_node_pool *pool = &cc_mem.pools[node];
+		while (pool->nb_free_blocks > 0 && nb_marked < max_nb_pages) {
+			struct page *block = cc_memory_pop_free_block(node);
+			cc_mem.block_free_pages[page_private(block)] = CC_BLOCK_RELEASED;
+			nb_marked += 1 << cc_mem.block_order;
+			nb_marked_blocks++;
+		}
+	}
+
+	// split blocks (of any order)
+	if (nb_marked < max_nb_pages && cc_mem.nb_free_whole_pages > 0) {
+		size_t nb_split_marked = 0;
+		for (i = 0; i < cc_mem.nb_allocated_blocks && nb_marked < max_nb_pages; ++i) {
+			unsigned int block_size = 1U << cc_mem.block_orders[i];
+			if (cc_mem.block_free_pages[i] == block_size) {
+				cc_mem.block_free_pages[i] = CC_BLOCK_RELEASED;
+				cc_mem.nb_free_whole_pages -= block_size;
+				nb_marked += block_size;
+				nb_marked_blocks++;
+				nb_split_marked++;
+			}
+		}
+		if (nb_split_marked > 0)
+			for_each_node_state(node, N_MEMORY) {
+				struct cc_node_pool *pool = &cc_mem.pools[node];
+				for (c = 0; c < nb_colors; ++c) {
+					cc_memory_store_remove_released(&pool->pages_by_color[c]);
+					cc_memory_store_remove_released(&pool->dirty_by_color[c]);
+				}
+				cc_memory_store_remove_released(&pool->dirty_blocks);
+			}
+	}
+
+	// release marked blocks (backward, so that moved blocks have already been checked)
+	for (i = cc_mem.nb_allocated_blocks; i > 0 && nb_marked_blocks > 0; --i) {
+		if (cc_mem.block_free_pages[i - 1] == CC_BLOCK_RELEASED) {
+			nb_released += 1 << cc_mem.block_orders[i - 1];
+			cc_memory_release_block(i - 1);
+			nb_marked_blocks--;
+		}
+	}
+	return nb_released;
+}
+
+/* Shrinker: the kernel asks for pages under memory pressure.
+ * Reclaim can happen while cc_mem is held (blocks are allocated under the lock), so locks are only tried.
+ * Free pages kept in per-cpu caches are drained before releasing blocks.
+ */
+static unsigned long cc_memory_shrinker_count(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	// racy read, only a hint for the kernel
+	return cc_mem.nb_free_whole_pages;
+}
+
+// locks: tries pcp caches and cc_mem
+static unsigned long cc_memory_shrinker_scan(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	size_t nb_released;
+
+	cc_pcp_drain(1);
+	if (!mutex_trylock(&cc_mem.mutex))
+		return SHRINK_STOP;
+	nb_released = cc_memory_release_blocks(sc->nr_to_scan);
+	mutex_unlock(&cc_mem.mutex);
+	return nb_released;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,12,0)
+// Old shrinker interface: one callback that scans nr_to_scan and returns the remaining count
+static int cc_memory_shrinker_shrink(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	if (sc->nr_to_scan > 0)
+		cc_memory_shrinker_scan(shrinker, sc);
+	return cc_memory_shrinker_count(shrinker, sc);
+}
+#endif
+
+static void cc_memory_shrinker_init(struct shrinker *shrinker)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,12,0)
+	shrinker->shrink = cc_memory_shrinker_shrink;
+#else
+	shrinker->count_objects = cc_memory_shrinker_count;
+	shrinker->scan_objects = cc_memory_shrinker_scan;
+#endif
+	shrinker->seeks = DEFAULT_SEEKS;
+}
+
+/* Periodic check for idleness: if no page was allocated during idle_release seconds,
+ * all free blocks are released (including pages of per-cpu caches).
+ *
+ * locks: uses pcp caches, then cc_mem
+ */
+static void cc_memory_release_work(struct work_struct *work)
+{
+	if (time_after(jiffies, cc_mem.last_use + idle_release * HZ)) {
+		size_t nb_released;
+		cc_pcp_drain(0);
+		mutex_lock(&cc_mem.mutex);
+		nb_released = cc_memory_release_blocks(cc_mem.nb_allocated_pages);
+		mutex_unlock(&cc_mem.mutex);
+		if (nb_released > 0)
+			printk(KERN_DEBUG "ccontrol: memory: idle, released %zu pages\n", nb_released);
+	}
+	queue_delayed_work(system_unbound_wq, &cc_mem.release_work, idle_release * HZ);
+}
+
+/* -------------- Color claims --------------- */
+
+static int cc_claims_init(void)
+{
+	mutex_init(&cc_claims.mutex);
+	INIT_LIST_HEAD(&cc_claims.groups);
+	cc_claims.owners = cc_kvmalloc(nb_colors * sizeof(struct cc_group *));
+	cc_claims.nb_pages = cc_kvmalloc(nb_colors * sizeof(size_t));
+	cc_claims.nb_lazy = cc_kvmalloc(nb_colors * sizeof(size_t));
+	if (cc_claims.owners == NULL || cc_claims.nb_pages == NULL || cc_claims.nb_lazy == NULL) {
+		kvfree(cc_claims.owners);
+		kvfree(cc_claims.nb_pages);
+		kvfree(cc_claims.nb_lazy);
+		return -ENOMEM;
+	}
+	memset(cc_claims.owners, 0, nb_colors * sizeof(struct cc_group *));
+	memset(cc_claims.nb_pages, 0, nb_colors * sizeof(size_t));
+	memset(cc_claims.nb_lazy, 0, nb_colors * sizeof(size_t));
+	return 0;
+}
+
+// locks: nothing (module init/exit only, every group is gone)
+static void cc_claims_destroy(void)
+{
+	kvfree(cc_claims.owners);
+	kvfree(cc_claims.nb_pages);
+	kvfree(cc_claims.nb_lazy);
+}
+
+// Drop the claims of a group. locks: needs cc_claims
+static void cc_claims_release_group(struct kref *ref)
+{
+	struct cc_group *group = container_of(ref, struct cc_group, ref);
+	int c;
+	for (c = 0; c < nb_colors; ++c)
+		if (cc_claims.owners[c] == group)
+			cc_claims.owners[c] = NULL;
+	list_del(&group->list);
+	kvfree(group->nb_pages);
+	kvfree(group->nb_lazy);
+	kfree(group);
+}
+
+// locks: uses cc_claims
+static void cc_claims_put_group(struct cc_group *group)
+{
+	if (group == NULL)
+		return;
+	mutex_lock(&cc_claims.mutex);
+	kref_put(&group->ref, cc_claims_release_group);
+	mutex_unlock(&cc_claims.mutex);
+}
+
+// Charge future pages of an area to the group of a file. locks: needs area_write, uses cc_claims
+static void cc_claims_bind_area(struct memory_area *area, struct cc_file *file)
+{
+	mutex_lock(&cc_claims.mutex);
+	area->group = file->group;
+	if (area->group != NULL)
+		kref_get(&area->group->ref);
+	mutex_unlock(&cc_claims.mutex);
+}
+
+// locks: needs area_write, uses cc_claims
+static void cc_claims_unbind_area(struct memory_area *area)
+{
+	cc_claims_put_group(area->group);
+	area->group = NULL;
+}
+
+// locks: needs cc_claims
+static void cc_claims_remove_pages(struct cc_group *group, struct page **pages, size_t nb_pages)
+{
+	size_t i;
+	for (i = 0; i < nb_pages; ++i) {
+		int c = pfn_to_color(page_to_pfn(pages[i]));
+		cc_claims.nb_pages[c]--;
+		if (group != NULL)
+			group->nb_pages[c]--;
+	}
+}
+
+/* Charge pages to a group (or to no group), all or nothing.
+ * If check is set, fails if a color is claimed by another group (-EACCES),
+ * or if the group quota is exceeded (-EDQUOT).
+ *
+ * locks: needs cc_claims
+ */
+static int cc_claims_add_pages(struct cc_group *group, struct page **pages, size_t nb_pages, int check)
+{
+	size_t i;
+	for (i = 0; i < nb_pages; ++i) {
+		int c = pfn_to_color(page_to_pfn(pages[i]));
+		if (check && cc_claims.owners[c] != NULL && cc_claims.owners[c] != group) {
+			printk(KERN_WARNING "ccontrol: claims: color %d is claimed by another group\n", c);
+			cc_claims_remove_pages(group, pages, i);
+			return -EACCES;
+		}
+		if (check && group != NULL && group->max_pages > 0 && group->nb_pages[c] >= group->max_pages) {
+			printk(KERN_WARNING "ccontrol: claims: quota of color %d exceeded\n", c);
+			cc_claims_remove_pages(group, pages, i);
+			return -EDQUOT;
+		}
+		cc_claims.nb_pages[c]++;
+		if (group != NULL)
+			group->nb_pages[c]++;
+	}
+	return 0;
+}
+
+// locks: uses cc_claims
+static int cc_claims_charge_pages(struct cc_group *group, struct page **pages, size_t nb_pages)
+{
+	int err;
+	mutex_lock(&cc_claims.mutex);
+	err = cc_claims_add_pages(group, pages, nb_pages, 1);
+	mutex_unlock(&cc_claims.mutex);
+	return err;
+}
+
+// locks: uses cc_claims
+static void cc_claims_uncharge_pages(struct cc_group *group, struct page **pages, size_t nb_pages)
+{
+	mutex_lock(&cc_claims.mutex);
+	cc_claims_remove_pages(group, pages, nb_pages);
+	mutex_unlock(&cc_claims.mutex);
+}
+
+/* Replace the charge of old pages by the charge of new pages (recolor), all or nothing.
+ * Old pages do not count in the quota of the group during the check.
+ *
+ * locks: uses cc_claims
+ */
+static int cc_claims_recharge_pages(struct cc_group *group, struct page **new, struct page **old, size_t nb_pages)
+{
+	int err;
+	mutex_lock(&cc_claims.mutex);
+	cc_claims_remove_pages(group, old, nb_pages);
+	err = cc_claims_add_pages(group, new, nb_pages, 1);
+	if (err)
+		cc_claims_add_pages(group, old, nb_pages, 0);
+	mutex_unlock(&cc_claims.mutex);
+	return err;
+}
+
+/* Color of the t-th page of color_list entry i of a layout (pages of an entry cycle through its nested colors
+ * with CC_LAYOUT_INNER_COLORS).
+ */
+static int cc_layout_entry_color(struct cc_layout *config, int i, int t)
+{
+	if (config->flags & CC_LAYOUT_INNER_COLORS)
+		return cc_colors_nested(config->color_list[i], t);
+	return config->color_list[i];
+}
+
+/* Reserve (or release) the colors used by a lazy layout, once per layout whatever its size.
+ * Reserving fails if one of them is claimed by another group (-EACCES).
+ *
+ * locks: uses cc_claims
+ */
+static int cc_claims_reserve_layout(struct cc_group *group, struct cc_layout *config, int reserve)
+{
+	int i, t, c, nb_t = 1;
+	int err = 0;
+
+	if (config->flags & CC_LAYOUT_INNER_COLORS)
+		nb_t = (int) min_t(size_t, cc_colors_nb_nested(), (size_t) config->color_repeat * config->list_repeat);
+	mutex_lock(&cc_claims.mutex);
+	if (reserve) {
+		for (i = 0; i < config->nb_colors; ++i) {
+			for (t = 0; t < nb_t; ++t) {
+				c = cc_layout_entry_color(config, i, t);
+				if (cc_claims.owners[c] != NULL && cc_claims.owners[c] != group) {
+					printk(KERN_WARNING "ccontrol: claims: color %d is claimed by another group\n", c);
+					err = -EACCES;
+					goto err_claimed;
+				}
+			}
+		}
+	}
+	for (i = 0; i < config->nb_colors; ++i) {
+		for (t = 0; t < nb_t; ++t) {
+			c = cc_layout_entry_color(config, i, t);
+			cc_claims.nb_lazy[c] += reserve ? 1 : -1;
+			if (group != NULL)
+				group->nb_lazy[c] += reserve ? 1 : -1;
+		}
+	}
+err_claimed:
+	mutex_unlock(&cc_claims.mutex);
+	return err;
+}
+
+// locks: needs cc_claims
+static struct cc_group *cc_claims_new_group(const char *name)
+{
+	struct cc_group *group = kmalloc(sizeof(struct cc_group), GFP_KERNEL);
+	if (group == NULL)
+		return NULL;
+	group->nb_pages = cc_kvmalloc(nb_colors * sizeof(size_t));
+	group->nb_lazy = cc_kvmalloc(nb_colors * sizeof(size_t));
+	if (group->nb_pages == NULL || group->nb_lazy == NULL) {
+		kvfree(group->nb_pages);
+		kvfree(group->nb_lazy);
+		kfree(group);
+		return NULL;
+	}
+	memset(group->nb_pages, 0, nb_colors * sizeof(size_t));
+	memset(group->nb_lazy, 0, nb_colors * sizeof(size_t));
+	kref_init(&group->ref);
+	strlcpy(group->name, name, CC_AREA_NAME_MAX);
+	group->uid = current_fsuid();
+	group->max_pages = 0;
+	list_add(&group->list, &cc_claims.groups);
+	return group;
+}
+
+/* Make a file join the group of a claim (created if needed), then claim colors for the group.
+ * A file stays in its first group. A color can be claimed if every page of it is held by the group,
+ * and no lazy layout outside of the group uses it.
+ * An existing group can only be joined by its creator user (or with CAP_SYS_ADMIN).
+ * The quota only changes if max_pages is set, and only downwards without CAP_SYS_ADMIN (a tenant given
+ * a file of the group cannot lift the quota set by the administrator).
+ * On error, claims are unchanged.
+ *
+ * locks: uses cc_claims
+ */
+static int cc_claims_claim(struct cc_file *file, struct cc_claim *claim, int *colors)
+{
+	struct cc_group *group = file->group;
+	size_t max_pages = claim->max_pages == CC_CLAIM_NO_QUOTA ? 0 : claim->max_pages;
+	int i, err = 0;
+
+	mutex_lock(&cc_claims.mutex);
+	if (group != NULL) {
+		if (strcmp(group->name, claim->group) != 0) {
+			printk(KERN_WARNING "ccontrol: claims: file already belongs to group \"%s\"\n", group->name);
+			err = -EINVAL;
+			goto err_join;
+		}
+	} else {
+		struct cc_group *g;
+		if (claim->group[0] != '\0') {
+			list_for_each_entry(g, &cc_claims.groups, list) {
+				if (strcmp(g->name, claim->group) == 0) {
+					if (!uid_eq(current_fsuid(), g->uid) && !capable(CAP_SYS_ADMIN)) {
+						printk(KERN_WARNING "ccontrol: claims: group \"%s\" belongs to another user\n", g->name);
+						err = -EACCES;
+						goto err_join;
+					}
+					kref_get(&g->ref);
+					group = g;
+					break;
+				}
+			}
+		}
+		if (group == NULL)
+			group = cc_claims_new_group(claim->group);
+		if (group == NULL) {
+			err = -ENOMEM;
+			goto err_join;
+		}
+	}
+
+	if (claim->max_pages != 0 && !capable(CAP_SYS_ADMIN) &&
+			(max_pages == 0 || (group->max_pages != 0 && max_pages > group->max_pages))) {
+		printk(KERN_WARNING "ccontrol: claims: raising the quota of group \"%s\" needs CAP_SYS_ADMIN\n", group->name);
+		err = -EPERM;
+		goto err_claim;
+	}
+	for (i = 0; i < claim->nb_colors; ++i) {
+		int c = colors[i];
+		if ((cc_claims.owners[c] != NULL && cc_claims.owners[c] != group) ||
+				cc_claims.nb_pages[c] != group->nb_pages[c] || cc_claims.nb_lazy[c] != group->nb_lazy[c]) {
+			printk(KERN_WARNING "ccontrol: claims: color %d is used outside of group\n", c);
+			err = -EBUSY;
+			goto err_claim;
+		}
+	}
+	for (i = 0; i < claim->nb_colors; ++i)
+		cc_claims.owners[colors[i]] = group;
+	if (claim->max_pages != 0)
+		group->max_pages = max_pages;
+	file->group = group;
+	mutex_unlock(&cc_claims.mutex);
+	return 0;
+
+err_claim:
+	if (file->group == NULL)
+		kref_put(&group->ref, cc_claims_release_group);
+err_join:
+	mutex_unlock(&cc_claims.mutex);
+	return err;
+}
+
+/* -------------- Memory area ------------------- */
+
+// locks: nothing
+static int cc_memory_new_area(struct memory_area **area, struct inode *inode)
+{
+	struct memory_area *a;
+	a = kmalloc(sizeof(struct memory_area), GFP_KERNEL);
+	if (a == NULL) {
+		return -ENOMEM;
+	} else {
+		init_rwsem(&a->sem);
+		a->is_configured = 0;
+		a->vma_count = 0;
+		address_space_init_once(&a->mapping);
+		a->mapping.host = inode;
+		kref_init(&a->ref);
+		a->name[0] = '\0';
+
+		// What must be set in case of premature area destruction
+		a->config.color_list = NULL;
+		a->store.pages = NULL;
+		a->store.nb_pages = 0;
+		a->is_lazy = 0;
+		a->lazy_ranges = NULL;
+		a->nb_lazy_ranges = 0;
+		INIT_RADIX_TREE(&a->lazy_pages, GFP_ATOMIC); // nodes are preloaded (see cc_memory_fault_in)
+		spin_lock_init(&a->lazy_lock);
+		a->group = NULL;
+
+		mutex_lock(&cc_areas.mutex);
+		list_add(&a->list, &cc_areas.list);
+		mutex_unlock(&cc_areas.mutex);
+
+		*area = a;
+		return 0;
+	}
+}
+
+/* Release of the last reference (file or name): the area is only removed from the area list,
+ * under cc_areas. It is destroyed by the caller after dropping cc_areas (see cc_memory_put_area),
+ * so that opens and lookups do not wait for the pages of a big area to be given back.
+ *
+ * locks: needs cc_areas
+ */
+static void cc_memory_unlist_area(struct kref *ref)
+{
+	struct memory_area *area = container_of(ref, struct memory_area, ref);
+	list_del(&area->list);
+}
+
+static void cc_memory_lazy_release(struct memory_area *area, size_t first);
+
+// locks: uses cc_claims and cc_mem
+static void cc_memory_destroy_area(struct memory_area *area)
+{
+	/* Do not protect area access with area lock because its memory will disappear.
+	 * Called when the last reference (file or name) has been put, and the area is unlisted.
+	 * Files are released after every vma (and ioctl) using them is gone.
+	 */
+	ktime_t start = ktime_get();
+
+	// put colored pages back in storage, to be zeroed (uses cc_claims and cc_mem locks)
+	if (area->is_lazy) {
+		cc_memory_lazy_release(area, 0);
+	} else {
+		cc_claims_uncharge_pages(area->group, area->store.pages, area->store.nb_pages);
+		cc_memory_recycle_pages(area->store.pages, area->store.nb_pages);
+	}
+	cc_claims_put_group(area->group);
+	trace_ccontrol_destroy_area(area->store.nb_pages, ktime_us_delta(ktime_get(), start));
+
+	kfree(area->config.color_list);
+	kvfree(area->store.pages);
+	kfree(area);
+}
+
+// locks: uses cc_areas (then cc_claims and cc_mem if destroyed)
+static void cc_memory_put_area(struct memory_area *area)
+{
+	int released;
+	mutex_lock(&cc_areas.mutex);
+	released = kref_put(&area->ref, cc_memory_unlist_area);
+	mutex_unlock(&cc_areas.mutex);
+	if (released)
+		cc_memory_destroy_area(area);
+}
+
+// locks: needs cc_areas
+static struct memory_area *cc_memory_find_area(const char *name)
+{
+	struct memory_area *area;
+	list_for_each_entry(area, &cc_areas.list, list)
+		if (strcmp(area->name, name) == 0)
+			return area;
+	return NULL;
+}
+
+/* Named areas are shared like files of the given mode (the device itself is open to everyone).
+ * Attaching needs read and write permission (areas are always mapped read-write) for the class of the caller.
+ *
+ * locks: needs cc_areas
+ */
+static int cc_memory_may_attach(struct memory_area *area)
+{
+	umode_t mode = area->mode;
+	if (uid_eq(current_fsuid(), area->uid))
+		mode >>= 6;
+	else if (in_group_p(area->gid))
+		mode >>= 3;
+	if ((mode & 06) == 06 || capable(CAP_DAC_OVERRIDE))
+		return 0;
+	return -EACCES;
+}
+
+// Only the owner can unlink a name (as in a sticky directory). locks: needs cc_areas
+static int cc_memory_may_unlink(struct memory_area *area)
+{
+	if (uid_eq(current_fsuid(), area->uid) || capable(CAP_FOWNER))
+		return 0;
+	return -EPERM;
+}
+
+/* Give a name to an area: the name holds a reference, so the area and its pages stay alive
+ * without any open file, until unlinked. The caller owns the name, with permissions mode.
+ */
+// locks: uses cc_areas
+static int cc_memory_name_area(struct memory_area *area, const char *name, umode_t mode)
+{
+	int err = 0;
+	mutex_lock(&cc_areas.mutex);
+	if (area->name[0] != '\0') {
+		err = -EBUSY;
+	} else if (cc_memory_find_area(name) != NULL) {
+		err = -EEXIST;
+	} else {
+		strlcpy(area->name, name, CC_AREA_NAME_MAX);
+		area->uid = current_fsuid();
+		area->gid = current_fsgid();
+		area->mode = mode;
+		kref_get(&area->ref);
+	}
+	mutex_unlock(&cc_areas.mutex);
+	return err;
+}
+
+// Remove the name of an area, and its reference (area is destroyed if no file uses it)
+// locks: uses cc_areas (then cc_claims and cc_mem if destroyed)
+static int cc_memory_unlink_area(const char *name)
+{
+	struct memory_area *area;
+	int err = 0;
+	int released = 0;
+	mutex_lock(&cc_areas.mutex);
+	area = cc_memory_find_area(name);
+	if (area == NULL) {
+		err = -ENOENT;
+	} else {
+		err = cc_memory_may_unlink(area);
+		if (err == 0) {
+			area->name[0] = '\0';
+			released = kref_put(&area->ref, cc_memory_unlist_area);
+		}
+	}
+	mutex_unlock(&cc_areas.mutex);
+	if (released)
+		cc_memory_destroy_area(area);
+	return err;
+}
+
+/* Make a file use a named area instead of the area created at open.
+ * The created area must be untouched (not configured nor mapped).
+ * nb_pages is set to the size of the named area.
+ */
+// locks: uses cc_areas, area_read
+static int cc_memory_attach_area(struct file *filp, const char *name, size_t *nb_pages)
+{
+	struct cc_file *file = filp->private_data;
+	struct memory_area *area;
+	int err = 0;
+
+	mutex_lock(&cc_areas.mutex);
+	down_read(&file->created->sem);
+	if (file->area != file->created || file->created->is_configured || file->created->vma_count > 0)
+		err = -EBUSY;
+	up_read(&file->created->sem);
+	if (err)
+		goto err_locked;
+
+	area = cc_memory_find_area(name);
+	if (area == NULL) {
+		err = -ENOENT;
+		goto err_locked;
+	}
+	err = cc_memory_may_attach(area);
+	if (err)
+		goto err_locked;
+	kref_get(&area->ref);
+	file->area = area;
+	filp->f_mapping = &area->mapping;
+	mutex_unlock(&cc_areas.mutex);
+
+	down_read(&area->sem);
+	*nb_pages = area->store.nb_pages;
+	up_read(&area->sem);
+	return 0;
+
+err_locked:
+	mutex_unlock(&cc_areas.mutex);
+	return err;
+}
+
+// Drop name references of named areas (module exit, no file is open)
+static void cc_memory_destroy_named_areas(void)
+{
+	struct memory_area *area, *next;
+	LIST_HEAD(released);
+	mutex_lock(&cc_areas.mutex);
+	list_for_each_entry_safe(area, next, &cc_areas.list, list) {
+		if (area->name[0] != '\0') {
+			printk(KERN_DEBUG "ccontrol: area: destroying named area \"%s\"\n", area->name);
+			area->name[0] = '\0';
+			if (kref_put(&area->ref, cc_memory_unlist_area))
+				list_add(&area->list, &released);
+		}
+	}
+	mutex_unlock(&cc_areas.mutex);
+	list_for_each_entry_safe(area, next, &released, list)
+		cc_memory_destroy_area(area);
+}
+
+static size_t cc_layout_nb_pages(struct cc_layout *config)
+{
+	return (size_t) config->nb_colors * config->color_repeat * config->list_repeat;
+}
+
+/* Get a run of pages spread over the colors nested in an inner color:
+ * page j has the (j % nb_nested)-th nested color. All or nothing.
+ * Pages of each nested color are popped in a row into scratch (room for nb_pages), then interleaved.
+ *
+ * locks: uses pcp cache and cc_mem
+ */
+static int cc_memory_pop_nested_run(struct page **pages, size_t nb_pages, int inner_color, int node,
+		struct page **scratch)
+{
+	int t, nb_nested = cc_colors_nb_nested();
+	size_t k, n, filled = 0;
+
+	for (t = 0; t < nb_nested && t < nb_pages; t++) {
+		int err;
+		n = (nb_pages - t + nb_nested - 1) / nb_nested; // number of j < nb_pages with j % nb_nested == t
+		err = cc_pcp_pop_pages(&scratch[filled], n, cc_colors_nested(inner_color, t), node);
+		if (err) {
+			cc_pcp_push_pages(scratch, filled);
+			return err;
+		}
+		filled += n;
+	}
+
+	filled = 0;
+	for (t = 0; t < nb_nested && t < nb_pages; t++) {
+		n = (nb_pages - t + nb_nested - 1) / nb_nested;
+		for (k = 0; k < n; k++)
+			pages[t + k * nb_nested] = scratch[filled++];
+	}
+	return 0;
+}
+
+/* Get the pages of a layout into pages (in layout order), all or nothing.
+ *
+ * The pages of each color_list entry in one bulk pop into a temporary array,
+ * which is then spread in layout order.
+ * With CC_LAYOUT_INNER_COLORS, color_list entries are inner colors, and the pages of an entry
+ * cycle through the colors nested in it.
+ *
+ * locks: uses pcp cache and cc_mem
+ */
+static int cc_memory_fill_layout(struct page **pages, struct cc_layout *config)
+{
+	int err = 0;
+	size_t i, b;
+	int c;
+	size_t run = (size_t) config->color_repeat * config->list_repeat; // pages per color_list entry
+	struct page **runs;
+	struct page **scratch = NULL;
+
+	cc_mem.last_use = jiffies; // racy, only used to detect idleness
+
+	runs = cc_kvmalloc(cc_layout_nb_pages(config) * sizeof(struct page *));
+	if (runs == NULL)
+		return -ENOMEM;
+	if (config->flags & CC_LAYOUT_INNER_COLORS) {
+		scratch = cc_kvmalloc(run * sizeof(struct page *));
+		if (scratch == NULL) {
+			err = -ENOMEM;
+			goto err_obtain_runs;
+		}
+	}
+	for (c = 0; c < config->nb_colors; c++) {
+		if (config->flags & CC_LAYOUT_INNER_COLORS)
+			err = cc_memory_pop_nested_run(&runs[c * run], run, config->color_list[c], config->node, scratch);
+		else
+			err = cc_pcp_pop_pages(&runs[c * run], run, config->color_list[c], config->node);
+		if (err) {
+			cc_pcp_push_pages(runs, c * run);
+			goto err_obtain_runs;
+		}
+	}
+
+	// page (i, c, b) of the layout is runs[c][i * color_repeat + b]
+	for (i = 0; i < config->list_repeat; i++)
+		for (c = 0; c < config->nb_colors; c++)
+			for (b = 0; b < config->color_repeat; b++)
+				*pages++ = runs[c * run + i * config->color_repeat + b];
+
+err_obtain_runs:
+	kvfree(scratch); // kvfree(NULL) is a no-op
+	kvfree(runs);
+	return err;
+}
+
+/* Fill pages following an explicit color map (see struct cc_color_map).
+ * color_next must contain the number of pages of each color, it is used as scratch space (2 * nb_colors entries).
+ * Pages are popped with one batch per color, then placed in run order.
+ * Runs are read again from userspace (by chunks, in chunk buffer) and checked against the first pass.
+ *
+ * locks: uses pcp cache and cc_mem
+ */
+#define CC_MAP_CHUNK (PAGE_SIZE / sizeof(struct cc_color_run))
+
+static int cc_memory_fill_map(struct page **pages, size_t nb_pages, struct cc_color_map *map,
+		struct cc_color_run *chunk, size_t *color_next)
+{
+	int err = 0;
+	int c;
+	size_t i, k, offset = 0, filled = 0;
+	size_t *color_end = &color_next[nb_colors];
+	struct page **by_color;
+
+	cc_mem.last_use = jiffies; // racy, only used to detect idleness
+
+	by_color = cc_kvmalloc(nb_pages * sizeof(struct page *));
+	if (by_color == NULL)
+		return -ENOMEM;
+
+	// by_color[color_next[c], color_end[c][ are the pages of color c
+	for (c = 0; c < nb_colors; c++) {
+		size_t n = color_next[c];
+		if (n > 0) {
+			err = cc_pcp_pop_pages(&by_color[offset], n, c, map->node);
+			if (err) {
+				cc_pcp_push_pages(by_color, offset);
+				goto err_obtain_pages;
+			}
+		}
+		color_next[c] = offset;
+		offset += n;
+		color_end[c] = offset;
+	}
+
+	for (i = 0; i < map->nb_runs; i += CC_MAP_CHUNK) {
+		size_t n = min_t(size_t, CC_MAP_CHUNK, map->nb_runs - i);
+		if (copy_from_user(chunk, (struct cc_color_run __user *) map->runs + i, n * sizeof(struct cc_color_run))) {
+			err = -EFAULT;
+			goto err_place_pages;
+		}
+		for (k = 0; k < n; k++) {
+			c = chunk[k].color;
+			// runs may have been modified since the first pass
+			if (! (0 <= c && c < nb_colors && chunk[k].nb_pages <= color_end[c] - color_next[c])) {
+				err = -EINVAL;
+				goto err_place_pages;
+			}
+			memcpy(&pages[filled], &by_color[color_next[c]], chunk[k].nb_pages * sizeof(struct page *));
+			color_next[c] += chunk[k].nb_pages;
+			filled += chunk[k].nb_pages;
+		}
+		cond_resched();
+	}
+	if (filled != nb_pages)
+		err = -EINVAL;
+
+err_place_pages:
+	if (err)
+		cc_pcp_push_pages(by_color, nb_pages);
+err_obtain_pages:
+	kvfree(by_color);
+	return err;
+}
+
+// Color of page j of a layout (placed as by cc_memory_fill_layout)
+static int cc_layout_page_color(struct cc_layout *config, size_t j)
+{
+	size_t period = (size_t) config->nb_colors * config->color_repeat;
+	size_t b = j % config->color_repeat;
+	int i = (j % period) / config->color_repeat;
+	return cc_layout_entry_color(config, i, ((j / period) * config->color_repeat + b) % cc_colors_nb_nested());
+}
+
+// Range of a lazy area containing page offset index (ranges cover the area). locks: needs area (read or write)
+static struct cc_lazy_range *cc_lazy_find_range(struct memory_area *area, size_t index)
+{
+	int lo = 0, hi = area->nb_lazy_ranges - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (area->lazy_ranges[mid].first <= index)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return &area->lazy_ranges[lo];
+}
+
+// Page at offset index, NULL if not touched yet (lazy area). locks: needs area (read or write)
+static struct page *cc_area_page(struct memory_area *area, size_t index)
+{
+	struct page *page;
+	if (!area->is_lazy)
+		return area->store.pages[index];
+	rcu_read_lock();
+	page = radix_tree_lookup(&area->lazy_pages, index);
+	rcu_read_unlock();
+	return page;
+}
+
+/* Add a layout at the end of a lazy area: only the layout is recorded (whatever its size),
+ * and the colors it uses are reserved in claims.
+ *
+ * locks: needs area_write, uses cc_claims
+ */
+static int cc_memory_grow_lazy(struct memory_area *area, struct cc_layout *config)
+{
+	struct cc_lazy_range *ranges, *range;
+	int *color_list;
+	int err;
+
+	color_list = kmemdup(config->color_list, config->nb_colors * sizeof(int), GFP_KERNEL);
+	if (color_list == NULL)
+		return -ENOMEM;
+	ranges = krealloc(area->lazy_ranges, (area->nb_lazy_ranges + 1) * sizeof(struct cc_lazy_range), GFP_KERNEL);
+	if (ranges == NULL) {
+		err = -ENOMEM;
+		goto err_alloc;
+	}
+	area->lazy_ranges = ranges;
+	err = cc_claims_reserve_layout(area->group, config, 1);
+	if (err)
+		goto err_alloc;
+
+	range = &ranges[area->nb_lazy_ranges++];
+	range->first = area->store.nb_pages;
+	range->nb_pages = cc_layout_nb_pages(config);
+	range->config = *config;
+	range->config.color_list = color_list;
+	area->store.nb_pages += range->nb_pages;
+	return 0;
+
+err_alloc:
+	kfree(color_list);
+	return err;
+}
+
+/* Give back the pages of a lazy area from page offset first (they must be unmapped), and drop the ranges
+ * starting there. A range cut by first is shortened, and keeps its claims reservation.
+ * Pages are looked up and removed from the tree by batches of CC_LAZY_BATCH.
+ *
+ * locks: needs area_write (or the last reference), uses cc_claims and cc_mem
+ */
+#define CC_LAZY_BATCH (PAGE_SIZE / (sizeof(struct page *) + sizeof(unsigned long)))
+
+static void cc_memory_lazy_release(struct memory_area *area, size_t first)
+{
+	struct page **pages, *one_page;
+	unsigned long *indices, one_index;
+	unsigned long next = first;
+	size_t i, n, batch = CC_LAZY_BATCH;
+	struct radix_tree_iter iter;
+	void **slot;
+	int r;
+
+	pages = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (pages != NULL) {
+		indices = (unsigned long *) &pages[CC_LAZY_BATCH];
+	} else {
+		// page by page
+		pages = &one_page;
+		indices = &one_index;
+		batch = 1;
+	}
+	do {
+		n = 0;
+		rcu_read_lock();
+		radix_tree_for_each_slot(slot, &area->lazy_pages, &iter, next) {
+			pages[n] = radix_tree_deref_slot(slot);
+			indices[n++] = iter.index;
+			if (n == batch)
+				break;
+		}
+		rcu_read_unlock();
+		if (n == 0)
+			break;
+		spin_lock(&area->lazy_lock);
+		for (i = 0; i < n; ++i)
+			radix_tree_delete(&area->lazy_pages, indices[i]);
+		spin_unlock(&area->lazy_lock);
+		cc_claims_uncharge_pages(area->group, pages, n);
+		cc_memory_recycle_pages(pages, n);
+		next = indices[n - 1] + 1;
+		cond_resched();
+	} while (n == batch);
+	if (batch != 1)
+		kfree(pages);
+
+	for (r = area->nb_lazy_ranges - 1; r >= 0 && area->lazy_ranges[r].first >= first; --r) {
+		cc_claims_reserve_layout(area->group, &area->lazy_ranges[r].config, 0);
+		kfree(area->lazy_ranges[r].config.color_list);
+	}
+	area->nb_lazy_ranges = r + 1;
+	if (r >= 0 && area->lazy_ranges[r].first + area->lazy_ranges[r].nb_pages > first)
+		area->lazy_ranges[r].nb_pages = first - area->lazy_ranges[r].first;
+	if (area->nb_lazy_ranges == 0) {
+		kfree(area->lazy_ranges);
+		area->lazy_ranges = NULL;
+	}
+}
+
+/* Get the pages of a layout (see cc_memory_fill_layout) charged to the area group, all or nothing.
+ *
+ * locks: uses pcp cache, cc_mem and cc_claims
+ */
+static int cc_memory_take_layout(struct memory_area *area, struct page **pages, struct cc_layout *config)
+{
+	size_t nb_pages = cc_layout_nb_pages(config);
+	int err = cc_memory_fill_layout(pages, config);
+	if (err)
+		return err;
+	err = cc_claims_charge_pages(area->group, pages, nb_pages);
+	if (err)
+		cc_pcp_push_pages(pages, nb_pages);
+	return err;
+}
+
+/* Add the pages of a layout at the end of the area store, charged to the area group.
+ * The page array is reallocated, existing pages do not move (mappings stay valid).
+ * Lazy areas only record the layout (see cc_memory_grow_lazy).
+ *
+ * locks: needs area_write, uses pcp cache, cc_mem and cc_claims
+ */
+static int cc_memory_grow_area(struct memory_area *area, struct cc_layout *config)
+{
+	int err;
+	size_t nb_pages = cc_layout_nb_pages(config);
+	struct page_storage *store = &area->store;
+	struct page **pages;
+
+	if (!!(config->flags & CC_LAYOUT_LAZY) != area->is_lazy) {
+		printk(KERN_WARNING "ccontrol: area: lazy and non lazy layouts cannot be mixed in an area\n");
+		return -EINVAL;
+	}
+	if (area->is_lazy)
+		return cc_memory_grow_lazy(area, config);
+
+	pages = cc_kvmalloc((store->nb_pages + nb_pages) * sizeof(struct page *));
+	if (pages == NULL)
+		return -ENOMEM;
+
+	// obtain pages (block cyclic layout)
+	err = cc_memory_take_layout(area, &pages[store->nb_pages], config);
+	if (err) {
+		kvfree(pages);
+		return err;
+	}
+
+	if (store->pages != NULL) {
+		memcpy(pages, store->pages, store->nb_pages * sizeof(struct page *));
+		kvfree(store->pages);
+	}
+	store->pages = pages;
+	store->nb_pages += nb_pages;
+	return 0;
+}
+
+// locks: uses area_write, pcp cache, cc_mem and cc_claims
+static int cc_memory_config_area(struct memory_area *area, struct cc_layout *config, struct cc_file *file)
+{
+	int err = 0;
+	size_t nb_pages = cc_layout_nb_pages(config);
+	ktime_t start = ktime_get();
+
+	down_write(&area->sem);
+
+	if (area->is_configured) {
+		printk(KERN_WARNING "ccontrol: area: reconfigure is unsupported (use append or truncate)\n");
+		err = -EPERM;
+		goto err_already_configured;
+	}
+
+	cc_claims_bind_area(area, file);
+	area->is_lazy = !!(config->flags & CC_LAYOUT_LAZY);
+	err = cc_memory_grow_area(area, config);
+	if (err) {
+		cc_claims_unbind_area(area);
+		area->is_lazy = 0;
+		goto err_obtain_pages;
+	}
+
+	area->config = *config; // get ownership of color_list kmalloc'ed buffer
+	area->is_configured = 1;
+
+err_obtain_pages:
+err_already_configured:
+	up_write(&area->sem);
+	trace_ccontrol_configure(config, nb_pages, ktime_us_delta(ktime_get(), start), err);
+	return err;
+}
+
+/* Configure an area with a sequence of layouts (segments), all or nothing.
+ * The page array is allocated once for the total size, and each segment is filled at its offset.
+ * The area keeps the first config (and takes ownership of its color list), others are freed by caller.
+ */
+// locks: uses area_write, pcp cache, cc_mem and cc_claims
+static int cc_memory_config_segments(struct memory_area *area, struct cc_layout *configs, int nb_segments,
+		struct cc_file *file)
+{
+	int err = 0;
+	int i;
+	int is_lazy = !!(configs[0].flags & CC_LAYOUT_LAZY);
+	size_t nb_pages = 0, filled = 0;
+	struct page **pages = NULL;
+	ktime_t start = ktime_get();
+
+	down_write(&area->sem);
+
+	if (area->is_configured) {
+		printk(KERN_WARNING "ccontrol: area: reconfigure is unsupported (use append or truncate)\n");
+		err = -EPERM;
+		goto err_already_configured;
+	}
+	for (i = 0; i < nb_segments; ++i) {
+		size_t n = cc_layout_nb_pages(&configs[i]);
+		if (!!(configs[i].flags & CC_LAYOUT_LAZY) != is_lazy) {
+			printk(KERN_WARNING "ccontrol: area: lazy and non lazy layouts cannot be mixed in an area\n");
+			err = -EINVAL;
+			goto err_already_configured;
+		}
+		if (n > SIZE_MAX / sizeof(struct page *) - nb_pages) {
+			printk(KERN_WARNING "ccontrol: area: segments are too big\n");
+			err = -EINVAL;
+			goto err_already_configured;
+		}
+		nb_pages += n;
+	}
+
+	cc_claims_bind_area(area, file);
+	area->is_lazy = is_lazy;
+	if (is_lazy) {
+		// only layouts are recorded
+		for (i = 0; i < nb_segments && err == 0; ++i)
+			err = cc_memory_grow_area(area, &configs[i]);
+		if (err)
+			cc_memory_lazy_release(area, 0);
+	} else {
+		pages = cc_kvmalloc(nb_pages * sizeof(struct page *));
+		if (pages == NULL)
+			err = -ENOMEM;
+		for (i = 0; i < nb_segments && err == 0; ++i) {
+			err = cc_memory_take_layout(area, &pages[filled], &configs[i]);
+			if (err == 0)
+				filled += cc_layout_nb_pages(&configs[i]);
+		}
+		if (err == 0) {
+			area->store.pages = pages;
+			area->store.nb_pages = nb_pages;
+		} else if (pages != NULL) {
+			// give back pages of previous segments (never mapped, still clean)
+			cc_claims_uncharge_pages(area->group, pages, filled);
+			cc_pcp_push_pages(pages, filled);
+			kvfree(pages);
+		}
+	}
+
+	if (err) {
+		cc_claims_unbind_area(area);
+		area->store.nb_pages = 0;
+		area->is_lazy = 0;
+	} else {
+		area->config = configs[0]; // get ownership of color_list kmalloc'ed buffer
+		area->is_configured = 1;
+	}
+
+err_already_configured:
+	up_write(&area->sem);
+	trace_ccontrol_configure(&configs[0], nb_pages, ktime_us_delta(ktime_get(), start), err);
+	return err;
+}
+
+/* Configure an area with an explicit color map of nb_pages pages (see cc_memory_fill_map).
+ * The area config only keeps the flags and node of the map.
+ */
+// locks: uses area_write, pcp cache, cc_mem and cc_claims
+static int cc_memory_config_map(struct memory_area *area, struct cc_color_map *map, size_t nb_pages,
+		struct cc_color_run *chunk, size_t *color_next, struct cc_file *file)
+{
+	int err = 0;
+	struct page **pages;
+	struct cc_layout traced = { .color_list = NULL, .flags = map->flags, .node = map->node }; // no color list
+	ktime_t start = ktime_get();
+
+	down_write(&area->sem);
+
+	if (area->is_configured) {
+		printk(KERN_WARNING "ccontrol: area: reconfigure is unsupported (use append or truncate)\n");
+		err = -EPERM;
+		goto err_already_configured;
+	}
+
+	pages = cc_kvmalloc(nb_pages * sizeof(struct page *));
+	if (pages == NULL) {
+		err = -ENOMEM;
+		goto err_already_configured;
+	}
+	err = cc_memory_fill_map(pages, nb_pages, map, chunk, color_next);
+	if (err) {
+		kvfree(pages);
+		goto err_already_configured;
+	}
+	cc_claims_bind_area(area, file);
+	err = cc_claims_charge_pages(area->group, pages, nb_pages);
+	if (err) {
+		cc_claims_unbind_area(area);
+		cc_pcp_push_pages(pages, nb_pages);
+		kvfree(pages);
+		goto err_already_configured;
+	}
+
+	area->store.pages = pages;
+	area->store.nb_pages = nb_pages;
+	memset(&area->config, 0, sizeof(struct cc_layout));
+	area->config.flags = map->flags;
+	area->config.node = map->node;
+	area->is_configured = 1;
+
+err_already_configured:
+	up_write(&area->sem);
+	trace_ccontrol_configure(&traced, nb_pages, ktime_us_delta(ktime_get(), start), err);
+	return err;
+}
+
+/* Append pages with a new layout at the end of a configured area.
+ * Existing mappings are untouched, and can be extended with mremap to cover the new pages.
+ * The color list of config is not kept (freed by caller).
+ */
+// locks: uses area_write, pcp cache, cc_mem and cc_claims
+static int cc_memory_append_area(struct memory_area *area, struct cc_layout *config)
+{
+	int err;
+	down_write(&area->sem);
+	if (area->is_configured)
+		err = cc_memory_grow_area(area, config);
+	else
+		err = -ENODEV;
+	up_write(&area->sem);
+	return err;
+}
+
+/* Release trailing pages of an area, keeping the first nb_pages.
+ * Pages are unmapped from every vma mapping the area before going back to the storage.
+ * Later accesses to the released range get a SIGBUS.
+ */
+// locks: uses area_write, pcp cache, cc_mem and cc_claims
+static int cc_memory_truncate_area(struct memory_area *area, size_t nb_pages)
+{
+	int err = 0;
+	struct page_storage *store = &area->store;
+
+	down_write(&area->sem);
+
+	if (!area->is_configured) {
+		err = -ENODEV;
+		goto err_bad_arg;
+	}
+	if (nb_pages > store->nb_pages) {
+		printk(KERN_WARNING "ccontrol: area: truncate to %zu pages above area size %zu\n",
+				nb_pages, store->nb_pages);
+		err = -EINVAL;
+		goto err_bad_arg;
+	}
+
+	// remove pte of released pages (faults are blocked by area lock)
+	unmap_mapping_range(&area->mapping, (loff_t) nb_pages << PAGE_SHIFT, 0, 1);
+
+	if (area->is_lazy) {
+		cc_memory_lazy_release(area, nb_pages);
+	} else {
+		cc_claims_uncharge_pages(area->group, &store->pages[nb_pages], store->nb_pages - nb_pages);
+		cc_memory_recycle_pages(&store->pages[nb_pages], store->nb_pages - nb_pages);
+	}
+	store->nb_pages = nb_pages;
+	// page array is not shrinked, it will be reallocated by the next append (unless empty, see store invariant)
+	if (nb_pages == 0) {
+		kvfree(store->pages);
+		store->pages = NULL;
+	}
+
+err_bad_arg:
+	up_write(&area->sem);
+	return err;
+}
+
+// Copy page content to another page
+static void cc_memory_move(struct page *dst, struct page *src)
+{
+	copy_highpage(dst, src);
+}
+
+/* Recolor pages [offset, offset + layout size[ of an area: new pages are taken following config,
+ * the content of old pages is copied, and old pages go back to the storage.
+ * Old pages are unmapped first: the next access to the range faults and maps the new pages.
+ * The color list of config is not kept (freed by caller).
+ */
+// locks: uses area_write, pcp cache, cc_mem and cc_claims
+static int cc_memory_recolor_area(struct memory_area *area, size_t offset, struct cc_layout *config)
+{
+	int err = 0;
+	size_t i;
+	size_t nb_pages = cc_layout_nb_pages(config);
+	struct page **pages;
+
+	down_write(&area->sem);
+
+	if (!area->is_configured) {
+		err = -ENODEV;
+		goto err_bad_arg;
+	}
+	if ((config->flags & CC_LAYOUT_LAZY) || area->is_lazy) {
+		printk(KERN_WARNING "ccontrol: area: recolor of lazy areas or with a lazy layout is unsupported\n");
+		err = -EINVAL;
+		goto err_bad_arg;
+	}
+	if (offset > area->store.nb_pages || nb_pages > area->store.nb_pages - offset) {
+		printk(KERN_WARNING "ccontrol: area: recolor [%zu, %zu[ out of bounds [0, %zu[\n",
+				offset, offset + nb_pages, area->store.nb_pages);
+		err = -EINVAL;
+		goto err_bad_arg;
+	}
+
+	pages = cc_kvmalloc(nb_pages * sizeof(struct page *));
+	if (pages == NULL) {
+		err = -ENOMEM;
+		goto err_bad_arg;
+	}
+	err = cc_memory_fill_layout(pages, config);
+	if (err)
+		goto err_obtain_pages;
+
+	// remove pte of old pages (faults are blocked by area lock, so they cannot be written during copy)
+	unmap_mapping_range(&area->mapping, (loff_t) offset << PAGE_SHIFT, (loff_t) nb_pages << PAGE_SHIFT, 1);
+
+	/* Old pages still pinned after unmap (pending direct I/O for instance) would be written after the copy,
+	 * and the data lost: refuse, the range stays mapped to the old pages on next access.
+	 */
+	for (i = 0; i < nb_pages; ++i) {
+		struct page *old = area->store.pages[offset + i];
+		if (cc_page_is_pinned(old)) {
+			printk(KERN_WARNING "ccontrol: area: recolor of pinned page %zu, retry after I/O completes\n",
+					offset + i);
+			err = -EBUSY;
+			break;
+		}
+	}
+	if (err == 0)
+		err = cc_claims_recharge_pages(area->group, pages, &area->store.pages[offset], nb_pages);
+	if (err) {
+		cc_pcp_push_pages(pages, nb_pages);
+		goto err_obtain_pages;
+	}
+
+	for (i = 0; i < nb_pages; ++i) {
+		struct page *old = area->store.pages[offset + i];
+		cc_memory_move(pages[i], old);
+		area->store.pages[offset + i] = pages[i];
+		pages[i] = old;
+		cond_resched();
+	}
+
+	// give back old pages
+	cc_memory_recycle_pages(pages, nb_pages);
+
+err_obtain_pages:
+	kvfree(pages);
+err_bad_arg:
+	up_write(&area->sem);
+	return err;
+}
+
+/* --------- Module device operations ------- */
+
+// Area used by an open file of the device
+static struct memory_area *cc_file_area(struct file *filp)
+{
+	return ((struct cc_file *) filp->private_data)->area;
+}
+
+// locks: uses cc_areas
+static int cc_device_open(struct inode *inode, struct file *filp)
+{
+	int err;
+	struct cc_file *file;
+	if (inode->i_cdev != &cc_dev.cdev) {
+		printk(KERN_ERR "ccontrol: device open: inode cdev is not device cdev\n");
+		return -EPERM;
+	}
+	file = kmalloc(sizeof(struct cc_file), GFP_KERNEL);
+	if (file == NULL)
+		return -ENOMEM;
+	err = cc_memory_new_area(&file->created, inode);
+	if (err) {
+		kfree(file);
+		return err;
+	}
+	file->area = file->created;
+	file->group = NULL;
+	filp->private_data = file;
+	filp->f_mapping = &file->area->mapping;
+	return 0;
+}
+
+// locks: uses cc_areas, cc_claims (and cc_mem if areas are destroyed)
+static int cc_device_release(struct inode *inode, struct file *filp)
+{
+	struct cc_file *file = filp->private_data;
+	if (file->area != file->created)
+		cc_memory_put_area(file->area);
+	cc_memory_put_area(file->created);
+	cc_claims_put_group(file->group);
+	kfree(file);
+	return 0;
+}
+
+// locks: nothing (only reads module data)
+static void cc_ioctl_info (struct cc_module_info *info)
+{
+	info->nb_colors = nb_colors;
+	info->nb_cache_colors = cc_colors.nb_cache_colors;
+	info->nb_bank_colors = cc_colors.nb_bank_colors;
+	info->nb_inner_colors = cc_colors.nb_inner_colors;
+	info->block_size = PAGE_SIZE;
+	info->color_list_size_max = color_list_size_max;
+	info->nb_nodes = nr_node_ids;
+}
+
+static int cc_ioctl_config (struct cc_layout *config, struct file *filp)
+{
+	ktime_t start = ktime_get();
+	int err = cc_memory_config_area(cc_file_area(filp), config, filp->private_data);
+	cc_stats_configure(start, err);
+	return err;
+}
+
+// Check the node of a layout, or set the default node. locks: nothing
+static int cc_ioctl_get_node (int flags, int *node)
+{
+	if (flags & CC_LAYOUT_NODE) {
+		if (! (0 <= *node && *node < nr_node_ids && node_state(*node, N_MEMORY))) {
+			printk(KERN_WARNING "ccontrol: area: node %d has no memory\n", *node);
+			return -EINVAL;
+		}
+	} else {
+		// default to the nearest node with memory
+		*node = numa_mem_id();
+	}
+	return 0;
+}
+
+/* Copy and check a layout from userspace.
+ * On success, config->color_list is a kmalloc'ed copy of the user color list.
+ */
+// locks: nothing
+static int cc_ioctl_get_layout (struct cc_layout *config, void __user *arg)
+{
+	int i, err, max_color;
+	int *config_color_list;
+	size_t bytes;
+
+	// get config
+	if (copy_from_user(config, arg, sizeof(struct cc_layout)))
+		return -EFAULT;
+
+	// check config arguments
+	if (config->nb_colors < 1 || config->color_repeat < 1 || config->list_repeat < 1) {
+		printk(KERN_WARNING "ccontrol: area: bad config {nb_color=%d, color_repeat=%d, list_repeat=%d}\n",
+				config->nb_colors, config->color_repeat, config->list_repeat);
+		return -EINVAL;
+	}
+	if (config->flags & ~CC_LAYOUT_FLAGS) {
+		printk(KERN_WARNING "ccontrol: area: unknown config flags 0x%x\n", config->flags);
+		return -EINVAL;
+	}
+	if ((config->flags & CC_LAYOUT_LAZY) && (config->flags & CC_LAYOUT_POPULATE)) {
+		printk(KERN_WARNING "ccontrol: area: lazy layouts cannot be populated\n");
+		return -EINVAL;
+	}
+	if (cc_ioctl_get_node(config->flags, &config->node))
+		return -EINVAL;
+	if (config->nb_colors > color_list_size_max) {
+		printk(KERN_WARNING "ccontrol: color list exceeds max size (%d > %d)\n",
+				config->nb_colors, color_list_size_max);
+		return -EPERM;
+	}
+
+	// get color list (check size before kmalloc)
+	bytes = config->nb_colors * sizeof(int);
+	config_color_list = kmalloc(bytes, GFP_KERNEL);
+	if (config_color_list == NULL)
+		return -ENOMEM;
+	if (copy_from_user(config_color_list, (int __user *) config->color_list, bytes)) {
+		err = -EFAULT;
+		goto err_after_kmalloc;
+	}
+	max_color = (config->flags & CC_LAYOUT_INNER_COLORS) ? cc_colors.nb_inner_colors : nb_colors;
+	for (i = 0; i < config->nb_colors; ++i) {
+		if (! (0 <= config_color_list[i] && config_color_list[i] < max_color)) {
+			printk(KERN_WARNING "ccontrol: color_list[%d]=%d is not an available color\n",
+					i, config_color_list[i]);
+			err = -EINVAL;
+			goto err_after_kmalloc;
+		}
+	}
+	config->color_list = config_color_list;
+	return 0;
+
+err_after_kmalloc:
+	kfree(config_color_list);
+	return err;
 }
 
-/* push: put page into store
- * pop: get page from store (potentially allocate new ones if empty)
- * refill_storage: get  new page block from system and put it into store
- *
- * locks: needs cc_mem
+/* Copy and check segment layouts from userspace, then configure the area.
+ * Color lists are freed here, except the first one on success (kept by the area).
  */
-static void cc_memory_push_page(struct page *p);
-static int cc_memory_pop_page(struct page **p, int color);
-static int cc_memory_refill_storage(void);
-
-static void cc_memory_push_page(struct page *p)
+// locks: nothing (deferred to cc_memory_config_segments)
+static int cc_ioctl_config_segments (struct file *filp, void __user *arg)
 {
-	struct page_storage *store = &cc_mem.pages_by_color[pfn_to_color(page_to_pfn(p))];
-	store->pages[store->nb_pages] = p;
-	store->nb_pages++;
-}
+	struct cc_segments segments;
+	struct cc_layout *configs;
+	int i, nb_copied, err = 0;
+	ktime_t start = ktime_get();
 
-static int cc_memory_pop_page(struct page **p, int color)
-{
-	struct page_storage *store = &cc_mem.pages_by_color[color];
-	if (store->nb_pages == 0) {
-		int err = cc_memory_refill_storage();
-		if (err < 0)
-			return err;
+	if (copy_from_user(&segments, arg, sizeof(struct cc_segments)))
+		return -EFAULT;
+	if (segments.nb_segments < 1 || segments.nb_segments > CC_SEGMENTS_MAX) {
+		printk(KERN_WARNING "ccontrol: area: bad number of segments %d (max %d)\n",
+				segments.nb_segments, CC_SEGMENTS_MAX);
+		return -EINVAL;
 	}
-	store->nb_pages--;
-	*p = store->pages[store->nb_pages];
-	return 0;
-}
 
-static int cc_memory_refill_storage(void)
-{
-	struct page *page;
-	int i;
-	if (cc_mem.nb_allocated_blocks == cc_mem.max_allocated_blocks) {
-		printk(KERN_ERR "ccontrol: memory: reached max_mem limit\n");
+	configs = kmalloc(segments.nb_segments * sizeof(struct cc_layout), GFP_KERNEL);
+	if (configs == NULL)
 		return -ENOMEM;
+	for (nb_copied = 0; nb_copied < segments.nb_segments; ++nb_copied) {
+		err = cc_ioctl_get_layout(&configs[nb_copied], (struct cc_layout __user *) segments.layouts + nb_copied);
+		if (err)
+			goto err_get_layouts;
 	}
 
-	/* GPF_HIGHUSER is for userspace memory, in a big space.
-	 *	__GFP_COMP is to let the kernel consider this page block "as a unit".
-	 *	More specifically, it is required to use this flag if using vm_insert_pages.
-	 * See https://lkml.org/lkml/2006/3/16/170
-	 */
-	page = alloc_pages(GFP_HIGHUSER | __GFP_COMP, cc_mem.block_order);
-	if (page == NULL)
-		return -ENOMEM;
+	err = cc_memory_config_segments(cc_file_area(filp), configs, segments.nb_segments, filp->private_data);
+	cc_stats_configure(start, err);
 
-	// Store and split page block by color
-	cc_mem.allocated_blocks[cc_mem.nb_allocated_blocks++] = page;
-	for (i = 0; i < 1 << cc_mem.block_order; i++)
-		cc_memory_push_page(nth_page(page, i));
-	return 0;
+err_get_layouts:
+	for (i = (err == 0) ? 1 : 0; i < nb_copied; ++i)
+		kfree(configs[i].color_list);
+	kfree(configs);
+	return err;
 }
 
-/* -------------- Memory area ------------------- */
-
-// locks: nothing
-static int cc_memory_new_area(struct memory_area **area)
+/* Copy and check a color map from userspace (runs are read by chunks), then configure the area.
+ * The number of pages is bounded by the module memory budget.
+ */
+// locks: nothing (deferred to cc_memory_config_map)
+static int cc_ioctl_config_map (struct file *filp, void __user *arg)
 {
-	struct memory_area *a;
-	a = kmalloc(sizeof(struct memory_area), GFP_KERNEL);
-	if (a == NULL) {
-		return -ENOMEM;
-	} else {
-		init_rwsem(&a->sem);
-		a->is_configured = 0;
-		a->vma_count = 0;
+	struct cc_color_map map;
+	struct cc_color_run *chunk;
+	size_t *color_next;
+	size_t i, k, nb_pages = 0;
+	size_t max_pages = cc_mem.max_allocated_pages;
+	int err = 0;
+	ktime_t start = ktime_get();
 
-		// What must be set in case of premature area destruction
-		a->config.color_list = NULL;
-		a->store.pages = NULL;
-		a->store.nb_pages = 0;
+	if (copy_from_user(&map, arg, sizeof(struct cc_color_map)))
+		return -EFAULT;
+	if (map.flags & ~CC_COLOR_MAP_FLAGS) {
+		printk(KERN_WARNING "ccontrol: area: unknown color map flags 0x%x\n", map.flags);
+		return -EINVAL;
+	}
+	if (cc_ioctl_get_node(map.flags, &map.node))
+		return -EINVAL;
 
-		*area = a;
-		return 0;
+	chunk = kmalloc(CC_MAP_CHUNK * sizeof(struct cc_color_run), GFP_KERNEL);
+	if (chunk == NULL)
+		return -ENOMEM;
+	color_next = cc_kvmalloc(2 * nb_colors * sizeof(size_t));
+	if (color_next == NULL) {
+		err = -ENOMEM;
+		goto err_color_next_alloc;
 	}
-}
+	memset(color_next, 0, nb_colors * sizeof(size_t));
 
-// locks: uses cc_mem
-static int cc_memory_destroy_area(struct memory_area *area)
-{
-	/* Do not protect area access with area lock because its memory will disappear.
-	 * Assume the kernel will call release after every reference to file descriptor
-	 * (and area) has been destroyed.
-	 */
+	// validate runs and count pages of each color
+	for (i = 0; i < map.nb_runs; i += CC_MAP_CHUNK) {
+		size_t n = min_t(size_t, CC_MAP_CHUNK, map.nb_runs - i);
+		if (copy_from_user(chunk, (struct cc_color_run __user *) map.runs + i, n * sizeof(struct cc_color_run))) {
+			err = -EFAULT;
+			goto err_bad_map;
+		}
+		for (k = 0; k < n; k++) {
+			if (! (0 <= chunk[k].color && chunk[k].color < nb_colors)) {
+				printk(KERN_WARNING "ccontrol: runs[%zu].color=%d is not an available color\n",
+						i + k, chunk[k].color);
+				err = -EINVAL;
+				goto err_bad_map;
+			}
+			if (chunk[k].nb_pages > max_pages - nb_pages) {
+				printk(KERN_WARNING "ccontrol: color map exceeds max_mem\n");
+				err = -ENOMEM;
+				goto err_bad_map;
+			}
+			color_next[chunk[k].color] += chunk[k].nb_pages;
+			nb_pages += chunk[k].nb_pages;
+		}
+		cond_resched();
+	}
+	if (nb_pages == 0) {
+		printk(KERN_WARNING "ccontrol: area: empty color map\n");
+		err = -EINVAL;
+		goto err_bad_map;
+	}
 
-	// put colored pages back in storage (uses cc_mem lock)
-	int i;
-	if (mutex_lock_interruptible(&cc_mem.mutex))
-		return -ERESTARTSYS;
-	for (i = 0; i < area->store.nb_pages; ++i)
-		cc_memory_push_page(area->store.pages[i]);
-	mutex_unlock(&cc_mem.mutex);
+	err = cc_memory_config_map(cc_file_area(filp), &map, nb_pages, chunk, color_next, filp->private_data);
+	cc_stats_configure(start, err);
 
-	kfree(area->config.color_list);
-	kvfree(area->store.pages);
-	kfree(area);
-	return 0;
+err_bad_map:
+	kvfree(color_next);
+err_color_next_alloc:
+	kfree(chunk);
+	return err;
 }
 
-static int cc_memory_config_area(struct memory_area *area, struct cc_layout *config)
+/* Copy and check a claim from userspace, then claim its colors.
+ */
+// locks: nothing (deferred to cc_claims_claim)
+static int cc_ioctl_claim (struct file *filp, void __user *arg)
 {
-	// TODO support reconfigure
-	int err = 0;
-	int i, b, c;
-	size_t nb_pages = config->nb_colors * config->color_repeat * config->list_repeat;
-	struct page_storage *store = &area->store;
+	struct cc_claim claim;
+	int *colors = NULL;
+	int i, err;
 
-	down_write(&area->sem);
-
-	if (area->is_configured) {
-		printk(KERN_WARNING "ccontrol: area: reconfigure is unsupported\n");
-		err = -EPERM;
-		goto err_already_configured;
+	if (copy_from_user(&claim, arg, sizeof(struct cc_claim)))
+		return -EFAULT;
+	if (strnlen(claim.group, CC_AREA_NAME_MAX) == CC_AREA_NAME_MAX) {
+		printk(KERN_WARNING "ccontrol: claims: invalid group name\n");
+		return -EINVAL;
 	}
-
-	store->nb_pages = 0;
-	store->pages = cc_kvmalloc(nb_pages * sizeof(struct page *));
-	if (store->pages == NULL) {
-		err = -ENOMEM;
-		goto err_kvmalloc_failed;
+	if (claim.nb_colors < 0 || claim.nb_colors > nb_colors) {
+		printk(KERN_WARNING "ccontrol: claims: bad number of colors %d\n", claim.nb_colors);
+		return -EINVAL;
+	}
+	// exclusive colors deny them to every other user of the device
+	if (claim.nb_colors > 0 && !capable(CAP_SYS_ADMIN)) {
+		printk(KERN_WARNING "ccontrol: claims: claiming colors needs CAP_SYS_ADMIN\n");
+		return -EPERM;
 	}
 
-	// obtain pages (block cyclic layout)
-	mutex_lock(&cc_mem.mutex);
-	for (i = 0; i < config->list_repeat; i++)
-		for (c = 0; c < config->nb_colors; c++)
-			for (b = 0; b < config->color_repeat; b++) {
-				err = cc_memory_pop_page(&store->pages[store->nb_pages], config->color_list[c]);
-				if (err)
-					goto err_obtain_pages;
-				store->nb_pages++;
+	if (claim.nb_colors > 0) {
+		size_t bytes = claim.nb_colors * sizeof(int);
+		colors = kmalloc(bytes, GFP_KERNEL);
+		if (colors == NULL)
+			return -ENOMEM;
+		if (copy_from_user(colors, (int __user *) claim.color_list, bytes)) {
+			err = -EFAULT;
+			goto err_bad_colors;
+		}
+		for (i = 0; i < claim.nb_colors; ++i) {
+			if (! (0 <= colors[i] && colors[i] < nb_colors)) {
+				printk(KERN_WARNING "ccontrol: claims: color_list[%d]=%d is not an available color\n",
+						i, colors[i]);
+				err = -EINVAL;
+				goto err_bad_colors;
 			}
-	mutex_unlock(&cc_mem.mutex);
-
-	area->config = *config; // get ownership of color_list kmalloc'ed buffer
-	area->is_configured = 1;
-	up_write(&area->sem);
-
-	if (0) {
-		char sx;
-		size_t sz;
-		printk(KERN_DEBUG "ccontrol: area: configured with {nb_color=%d, color_repeat=%d, list_repeat=%d}, nb_pages=%zu\n",
-				config->nb_colors, config->color_repeat, config->list_repeat, store->nb_pages);
-		sz = pretty_size(&sx, nb_pages * sizeof(struct page *));
-		printk(KERN_DEBUG "ccontrol: area: colored_pages_storage=%zu%c\n", sz, sx);
+		}
 	}
-	return 0;
+	err = cc_claims_claim(filp->private_data, &claim, colors);
 
-err_obtain_pages:
-	while (store->nb_pages > 0)
-		cc_memory_push_page(store->pages[--store->nb_pages]);
-	mutex_unlock(&cc_mem.mutex);
-	kvfree(store->pages);
-	store->pages = NULL;
-err_kvmalloc_failed:
-err_already_configured:
-	up_write(&area->sem);
+err_bad_colors:
+	kfree(colors); // kfree(NULL) is a no-op
 	return err;
 }
 
-/*static void cc_memory_move(void)
-  {
-  struct page *a = NULL;
-  struct page *b = NULL;
-  void *va, *vb;
-  va = kmap_atomic(a);
-  vb = kmap_atomic(b);
-  memcpy(va, vb, PAGE_SIZE);
-  kunmap_atomic(vb);
-  kunmap_atomic(va);
-  }*/
+/* Get the colors of the pages of a range of the calling process.
+ * Colors leak physical address bits, so this needs CAP_SYS_ADMIN unless the query_colors param is set.
+ * Present pages are found with __get_user_pages_fast, which walks page tables without faulting pages in
+ * (and without mmap_sem). The page reference it takes is dropped right away.
+ * Architectures without fast gup only have a stub always returning 0 (mm/util.c), so it is only used where
+ * the kernel implements it. Pages it misses (or every page without it) are looked up with get_user_pages
+ * under mmap_sem: since 4.9, FOLL_DUMP makes it fail on never touched anonymous memory instead of faulting
+ * it in. Older get_user_pages would populate such memory, so it is only used there without fast gup.
+ * Pages are processed by chunks of CC_QUERY_CHUNK pages, colors of a chunk are copied to userspace at once.
+ */
+#define CC_QUERY_CHUNK (PAGE_SIZE / (sizeof(struct page *) + sizeof(int)))
 
-/* --------- Module device operations ------- */
+#if defined(CONFIG_HAVE_GENERIC_RCU_GUP) || defined(CONFIG_X86) || defined(CONFIG_PPC) || defined(CONFIG_S390) || \
+		defined(CONFIG_SPARC64) || defined(CONFIG_SUPERH) || defined(CONFIG_MIPS)
+#define CC_HAVE_FAST_GUP
+#endif
+#if !defined(CC_HAVE_FAST_GUP) || LINUX_VERSION_CODE >= KERNEL_VERSION(4,9,0)
+#define CC_HAVE_SLOW_QUERY
+#endif
 
-// locks: nothing
-static int cc_device_open(struct inode *inode, struct file *filp)
+#ifdef CC_HAVE_SLOW_QUERY
+// locks: uses mmap_sem (read)
+static int cc_query_slow_pages(unsigned long start, int nb_pages, struct page **pages)
 {
-	if (inode->i_cdev != &cc_dev.cdev) {
-		printk(KERN_ERR "ccontrol: device open: inode cdev is not device cdev\n");
-		return -EPERM;
-	}
-	return cc_memory_new_area((struct memory_area **) &filp->private_data);
+	int n;
+	down_read(&current->mm->mmap_sem);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,6,0)
+	n = get_user_pages(current, current->mm, start, nb_pages, 0, 0, pages, NULL);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4,9,0)
+	n = get_user_pages(start, nb_pages, 0, 0, pages, NULL);
+#else
+	n = get_user_pages(start, nb_pages, FOLL_DUMP, pages, NULL);
+#endif
+	up_read(&current->mm->mmap_sem);
+	return n < 0 ? 0 : n;
 }
+#endif
 
-// locks: nothing
-static int cc_device_release(struct inode *inode, struct file *filp)
+/* Take a reference on the present pages at the start of [start, start + nb_pages pages[.
+ * Returns the number of pages found (the next one is not present).
+ *
+ * locks: uses mmap_sem (read) for pages missed by fast gup
+ */
+static int cc_query_pages(unsigned long start, int nb_pages, struct page **pages)
 {
-	return cc_memory_destroy_area(filp->private_data);
+	int n = 0;
+#ifdef CC_HAVE_FAST_GUP
+	n = __get_user_pages_fast(start, nb_pages, 0, pages);
+#endif
+#ifdef CC_HAVE_SLOW_QUERY
+	if (n < nb_pages)
+		n += cc_query_slow_pages(start + ((unsigned long) n << PAGE_SHIFT), nb_pages - n, &pages[n]);
+#endif
+	return n;
 }
 
-// locks: nothing (only reads module data)
-static void cc_ioctl_info (struct cc_module_info *info)
+// locks: nothing
+static int cc_ioctl_query (void __user *arg)
 {
-	info->nb_colors = nb_colors;
-	info->block_size = PAGE_SIZE;
-	info->color_list_size_max = color_list_size_max;
-}
+	struct cc_query query;
+	struct page **pages;
+	int *colors;
+	size_t *histogram = NULL;
+	unsigned long start;
+	size_t i, k, done = 0;
+	int err = 0;
 
-static int cc_ioctl_config (struct cc_layout *config, struct file *filp)
-{
-	return cc_memory_config_area(filp->private_data, config);
+	if (!query_colors && !capable(CAP_SYS_ADMIN)) {
+		printk(KERN_WARNING "ccontrol: query: needs CAP_SYS_ADMIN (or query_colors param)\n");
+		return -EPERM;
+	}
+	if (copy_from_user(&query, arg, sizeof(struct cc_query)))
+		return -EFAULT;
+	start = (unsigned long) query.start;
+	if ((start & ~PAGE_MASK) != 0 || query.nb_pages > (ULONG_MAX >> PAGE_SHIFT) ||
+			!access_ok(VERIFY_READ, start, query.nb_pages << PAGE_SHIFT)) {
+		printk(KERN_WARNING "ccontrol: query: bad range\n");
+		return -EINVAL;
+	}
+
+	// one page buffer: page pointers, then colors of the chunk
+	pages = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (pages == NULL)
+		return -ENOMEM;
+	colors = (int *) &pages[CC_QUERY_CHUNK];
+	if (query.histogram != NULL) {
+		histogram = cc_kvmalloc(nb_colors * sizeof(size_t));
+		if (histogram == NULL) {
+			err = -ENOMEM;
+			goto err_histogram_alloc;
+		}
+		memset(histogram, 0, nb_colors * sizeof(size_t));
+	}
+
+	query.nb_present = 0;
+	while (done < query.nb_pages) {
+		size_t n = min_t(size_t, CC_QUERY_CHUNK, query.nb_pages - done);
+		k = 0;
+		while (k < n) {
+			// pins the present pages at the start of the range
+			int nb_pinned = cc_query_pages(start + ((done + k) << PAGE_SHIFT), n - k, &pages[k]);
+			for (i = k; i < k + nb_pinned; ++i) {
+				colors[i] = pfn_to_color(page_to_pfn(pages[i]));
+				put_page(pages[i]);
+				if (histogram != NULL)
+					histogram[colors[i]]++;
+			}
+			query.nb_present += nb_pinned;
+			k += nb_pinned;
+			if (k < n)
+				colors[k++] = -1; // not present
+		}
+		if (query.colors != NULL && copy_to_user(query.colors + done, colors, n * sizeof(int))) {
+			err = -EFAULT;
+			goto err_copy;
+		}
+		done += n;
+		cond_resched();
+	}
+
+	if (histogram != NULL && copy_to_user(query.histogram, histogram, nb_colors * sizeof(size_t)))
+		err = -EFAULT;
+	else if (copy_to_user(&((struct cc_query __user *) arg)->nb_present, &query.nb_present, sizeof(size_t)))
+		err = -EFAULT;
+
+err_copy:
+	kvfree(histogram); // kvfree(NULL) is a no-op
+err_histogram_alloc:
+	kfree(pages);
+	return err;
 }
 
 // locks: nothing (deferred to sub ioctl functions)
@@ -438,6 +3545,8 @@ static long cc_device_ioctl(struct file *filp, unsigned int code, unsigned long
 	void __user *arg = (void __user *) val;
 	struct cc_module_info local_info;
 	struct cc_layout local_config;
+	size_t local_nb_pages;
+	struct cc_area_name local_name;
 	int err = 0;
 
 	if (_IOC_TYPE(code) != CCONTROL_IO_MAGIC) {
@@ -451,59 +3560,84 @@ static long cc_device_ioctl(struct file *filp, unsigned int code, unsigned long
 			err = copy_to_user(arg, &local_info, sizeof(struct cc_module_info));
 			break;
 		case CCONTROL_IO_CONFIG:
+			err = cc_ioctl_get_layout(&local_config, arg);
+			if (err)
+				break;
+			// ioctl (get ownership of kmalloced memory only on success)
+			err = cc_ioctl_config(&local_config, filp);
+			if (err)
+				kfree(local_config.color_list);
+			break;
+		case CCONTROL_IO_CONFIG_SEGMENTS:
+			err = cc_ioctl_config_segments(filp, arg);
+			break;
+		case CCONTROL_IO_CONFIG_MAP:
+			err = cc_ioctl_config_map(filp, arg);
+			break;
+		case CCONTROL_IO_CLAIM:
+			err = cc_ioctl_claim(filp, arg);
+			break;
+		case CCONTROL_IO_QUERY:
+			err = cc_ioctl_query(arg);
+			break;
+		case CCONTROL_IO_APPEND:
+			err = cc_ioctl_get_layout(&local_config, arg);
+			if (err)
+				break;
+			err = cc_memory_append_area(cc_file_area(filp), &local_config);
+			kfree(local_config.color_list);
+			break;
+		case CCONTROL_IO_RECOLOR:
 			{
-				int i;
-				int *config_color_list;
-				size_t bytes;
-
-				// get config
-				err = copy_from_user(&local_config, arg, sizeof(struct cc_layout));
-				if (err)
-					break;
-
-				// check config arguments
-				if (local_config.nb_colors < 1 || local_config.color_repeat < 1 || local_config.list_repeat < 1) {
-					printk(KERN_WARNING "ccontrol: area: bad config {nb_color=%d, color_repeat=%d, list_repeat=%d}\n",
-							local_config.nb_colors, local_config.color_repeat, local_config.list_repeat);
-					err = -EINVAL;
-					break;
-				}	
-				if (local_config.nb_colors > color_list_size_max) {
-					printk(KERN_WARNING "ccontrol: color list exceeds max size (%d > %d)\n",
-							local_config.nb_colors, color_list_size_max);
-					err = -EPERM;
-					break;
-				}
-
-				// get color list (check size before kmalloc)
-				bytes = local_config.nb_colors * sizeof(int);
-				config_color_list = kmalloc(bytes, GFP_KERNEL);
-				if (config_color_list == NULL) {
-					err = -ENOMEM;
+				struct cc_recolor __user *recolor = arg;
+				size_t offset;
+				if (copy_from_user(&offset, &recolor->offset, sizeof(size_t))) {
+					err = -EFAULT;
 					break;
 				}
-				err = copy_from_user(config_color_list, (int __user *) local_config.color_list, bytes);
-				if (err)
-					goto err_after_kmalloc;
-				for (i = 0; i < local_config.nb_colors; ++i) {
-					if (! (0 <= config_color_list[i] && config_color_list[i] < nb_colors)) {
-						printk(KERN_WARNING "ccontrol: color_list[%d]=%d is not an available color\n",
-								i, config_color_list[i]);
-						goto err_after_kmalloc;
-					}
-				}
-				local_config.color_list = config_color_list;
-
-				// ioctl (get ownership of kmalloced memory only on success)
-				err = cc_ioctl_config(&local_config, filp);
+				err = cc_ioctl_get_layout(&local_config, &recolor->layout);
 				if (err)
-					goto err_after_kmalloc;
+					break;
+				err = cc_memory_recolor_area(cc_file_area(filp), offset, &local_config);
+				kfree(local_config.color_list);
 				break;
-
-err_after_kmalloc:
-				kfree(config_color_list);
+			}
+		case CCONTROL_IO_TRUNCATE:
+			if (copy_from_user(&local_nb_pages, arg, sizeof(size_t))) {
+				err = -EFAULT;
+				break;
+			}
+			err = cc_memory_truncate_area(cc_file_area(filp), local_nb_pages);
+			break;
+		case CCONTROL_IO_NAME:
+		case CCONTROL_IO_ATTACH:
+		case CCONTROL_IO_UNLINK:
+			if (copy_from_user(&local_name, arg, sizeof(struct cc_area_name))) {
+				err = -EFAULT;
 				break;
 			}
+			if (! (0 < strnlen(local_name.name, CC_AREA_NAME_MAX) &&
+						strnlen(local_name.name, CC_AREA_NAME_MAX) < CC_AREA_NAME_MAX)) {
+				printk(KERN_WARNING "ccontrol: area: invalid area name\n");
+				err = -EINVAL;
+				break;
+			}
+			if (code == CCONTROL_IO_NAME) {
+				if (local_name.mode & ~0666) {
+					printk(KERN_WARNING "ccontrol: area: name mode 0%o is not read/write bits\n", local_name.mode);
+					err = -EINVAL;
+					break;
+				}
+				err = cc_memory_name_area(cc_file_area(filp), local_name.name,
+						local_name.mode != 0 ? local_name.mode : 0600);
+			} else if (code == CCONTROL_IO_UNLINK) {
+				err = cc_memory_unlink_area(local_name.name);
+			} else {
+				err = cc_memory_attach_area(filp, local_name.name, &local_name.nb_pages);
+				if (err == 0 && copy_to_user(arg, &local_name, sizeof(struct cc_area_name)))
+					err = -EFAULT;
+			}
+			break;
 		default:
 			printk(KERN_WARNING "ccontrol: invalid ioctl opcode: %u\n", code);
 			err = -ENOTTY;
@@ -513,21 +3647,104 @@ err_after_kmalloc:
 
 /* ------------ Mmap operation ------------- */
 
+/* Map area pages [first, last[ (page offsets in device) into the vma.
+ * Pages are inserted with vm_insert_page, which takes its own page reference.
+ * Pages that are already mapped are skipped, as well as pages of lazy areas not touched yet.
+ *
+ * locks: needs area (read or write)
+ */
+static int cc_vma_insert_pages(struct vm_area_struct *vma, struct memory_area *area, size_t first, size_t last)
+{
+	size_t index;
+	for (index = first; index < last; ++index) {
+		unsigned long address = vma->vm_start + ((index - vma->vm_pgoff) << PAGE_SHIFT);
+		struct page *page = cc_area_page(area, index); // may be added by a concurrent fault
+		int err;
+		if (page == NULL)
+			continue;
+		err = vm_insert_page(vma, address, page);
+		if (err && err != -EBUSY)
+			return err;
+		cond_resched();
+	}
+	return 0;
+}
+
+/* Take the page of a lazy area at first touch from storage (with the color of its layout range),
+ * and add it to the area pages. Faults only read lock the area: concurrent faults on the same page
+ * race on the insertion, and the losers give their page back.
+ *
+ * locks: needs area_read, uses pcp cache, cc_mem, cc_claims and lazy_lock
+ */
+static int cc_memory_fault_in(struct memory_area *area, size_t index)
+{
+	struct cc_lazy_range *range;
+	struct page *page;
+	int err;
+
+	if (!area->is_lazy || cc_area_page(area, index) != NULL)
+		return 0;
+	range = cc_lazy_find_range(area, index);
+	cc_mem.last_use = jiffies; // racy, only used to detect idleness
+	err = cc_pcp_pop_pages(&page, 1, cc_layout_page_color(&range->config, index - range->first), range->config.node);
+	if (err)
+		return err;
+	err = cc_claims_charge_pages(area->group, &page, 1);
+	if (err)
+		goto err_charge;
+	err = radix_tree_preload(GFP_KERNEL);
+	if (err)
+		goto err_insert;
+	spin_lock(&area->lazy_lock);
+	err = radix_tree_insert(&area->lazy_pages, index, page);
+	spin_unlock(&area->lazy_lock);
+	radix_tree_preload_end();
+	if (err == 0)
+		return 0;
+	if (err == -EEXIST)
+		err = 0; // added by a concurrent fault
+
+err_insert:
+	cc_claims_uncharge_pages(area->group, &page, 1);
+err_charge:
+	cc_pcp_push_pages(&page, 1);
+	return err;
+}
+
 // locks: uses area_read
 static int cc_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
-	int err = 0;
+	int err = VM_FAULT_NOPAGE;
 	struct memory_area *area = vma->vm_private_data;
-	// get the page offset in device
-	size_t index = vma->vm_pgoff + vmf->pgoff;
+	// page offset in device (vmf->pgoff already includes vma->vm_pgoff)
+	size_t index = vmf->pgoff;
+	size_t first, last;
 
+	atomic_long_inc(&cc_stats.nb_faults);
 	down_read(&area->sem);
 
 	if (index < area->store.nb_pages) {
-		vmf->page = area->store.pages[index];
-		get_page(vmf->page); // increase page ref count
+		/* Fault-around: map the aligned window of fault_around pages containing index,
+		 * clipped to the vma and area bounds. It avoids one fault per page on first touch.
+		 */
+		size_t window = max(fault_around, 1);
+		int fault_err = cc_memory_fault_in(area, index);
+		first = max((size_t) vma->vm_pgoff, rounddown(index, window));
+		last = min3(rounddown(index, window) + window,
+				(size_t) (vma->vm_pgoff + vma_pages(vma)), area->store.nb_pages);
+		if (fault_err) {
+			// no page of the color left, or claims refused it (not a kernel OOM, do not wake the OOM killer)
+			err = VM_FAULT_SIGBUS;
+			trace_ccontrol_fault(index, 0, -1, first, last, err);
+		} else {
+			struct page *page = cc_area_page(area, index);
+			if (cc_vma_insert_pages(vma, area, first, last) < 0)
+				err = VM_FAULT_OOM;
+			trace_ccontrol_fault(index, page_to_pfn(page), pfn_to_color(page_to_pfn(page)), first, last, err);
+		}
 	} else {
-		err = VM_FAULT_ERROR;
+		err = VM_FAULT_SIGBUS;
+		trace_ccontrol_fault(index, 0, -1, 0, 0, err);
 	}
 
 	up_read(&area->sem);
@@ -562,8 +3779,9 @@ static struct vm_operations_struct cc_vm_ops = {
 static int cc_device_mmap(struct file *filp, struct vm_area_struct *vma)
 {
 	int err = 0;
-	struct memory_area * area = filp->private_data;
+	struct memory_area * area = cc_file_area(filp);
 	size_t size = vma_pages(vma);
+	ktime_t start = ktime_get();
 
 	down_write(&area->sem);
 
@@ -591,19 +3809,32 @@ static int cc_device_mmap(struct file *filp, struct vm_area_struct *vma)
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,7,0)
 	vma->vm_flags |= VM_RESERVED | VM_CAN_NONLINEAR; // flags from old implementation
 #else
-	vma->vm_flags |= VM_IO; // prevents mlock, merge, swap, that may break things
+	vma->vm_flags |= VM_DONTDUMP; // area content is not part of core dumps (as with the former VM_IO)
 #endif
-	vma->vm_flags |= VM_DONTEXPAND; // prevent mremap
+	// mremap is allowed (to follow area append), faults outside the area give SIGBUS
+	/* Pages are inserted with vm_insert_page (also from fault handler), as normal refcounted pages.
+	 * VM_MIXEDMAP prevents mlock, merge and swap, but unlike VM_IO it lets get_user_pages pin them
+	 * (direct I/O, registered buffers). Pinned pages are kept out of storage until unpinned (see busy_pages).
+	 */
+	vma->vm_flags |= VM_MIXEDMAP;
 	vma->vm_private_data = area;
 
+	if (area->config.flags & CC_LAYOUT_POPULATE) {
+		// map the whole range now (mmap_sem is held for write, no concurrent fault)
+		err = cc_vma_insert_pages(vma, area, vma->vm_pgoff, vma->vm_pgoff + size);
+		if (err)
+			goto err_bad_arg;
+	}
+
 	area->vma_count++;
 
 err_bad_arg:
+	trace_ccontrol_mmap(vma->vm_pgoff, size, !!(area->config.flags & CC_LAYOUT_POPULATE),
+			ktime_us_delta(ktime_get(), start), err);
 	up_write(&area->sem);
 	return err;
 }
 
-// use vm_insert_page
 // zap_page_range
 // asm/pgtable.h : pfn_pte
 
@@ -677,6 +3908,139 @@ static void cc_device_destroy(void)
 	unregister_chrdev_region(cc_dev.id, 1);
 }
 
+/* --------- Debugfs statistics ------- */
+
+/* Files in <debugfs>/ccontrol:
+ * memory: blocks and free pages of each color in storage (per node)
+ * stats: refill, configure, fault and max_mem counters
+ * areas: live areas with their size
+ * claims: pages of each color held by areas, and groups with their claimed colors and pages
+ */
+
+// locks: uses cc_mem
+static int cc_debugfs_memory_show(struct seq_file *m, void *unused)
+{
+	int node, c;
+	mutex_lock(&cc_mem.mutex);
+	seq_printf(m, "block_order %d\n", cc_mem.block_order);
+	seq_printf(m, "min_order %d\n", cc_mem.min_order);
+	seq_printf(m, "allocated_blocks %zu\n", cc_mem.nb_allocated_blocks);
+	seq_printf(m, "allocated_pages %zu\n", cc_mem.nb_allocated_pages);
+	seq_printf(m, "max_pages %zu\n", cc_mem.max_allocated_pages);
+	seq_printf(m, "free_whole_pages %zu\n", cc_mem.nb_free_whole_pages);
+	seq_printf(m, "busy_pages %zu\n", cc_mem.busy_pages.nb_pages);
+	for_each_node_state(node, N_MEMORY) {
+		struct cc_node_pool *pool = &cc_mem.pools[node];
+		seq_printf(m, "node %d unsplit_blocks %zu free_pages_by_color", node, pool->nb_free_blocks);
+		for (c = 0; c < nb_colors; ++c)
+			seq_printf(m, " %zu", cc_memory_store(c, node)->nb_pages);
+		seq_putc(m, '\n');
+		seq_printf(m, "node %d dirty_blocks %zu dirty_pages_by_color", node, pool->dirty_blocks.nb_pages);
+		for (c = 0; c < nb_colors; ++c)
+			seq_printf(m, " %zu", pool->dirty_by_color[c].nb_pages);
+		seq_putc(m, '\n');
+	}
+	mutex_unlock(&cc_mem.mutex);
+	return 0;
+}
+
+// locks: nothing
+static int cc_debugfs_stats_show(struct seq_file *m, void *unused)
+{
+	int i;
+	seq_printf(m, "refills %ld\n", atomic_long_read(&cc_stats.nb_refills));
+	seq_printf(m, "refill_time_us %ld\n", atomic_long_read(&cc_stats.refill_time_us));
+	seq_printf(m, "refill_max_us %lu\n", cc_stats.refill_max_us);
+	seq_printf(m, "max_mem_reached %ld\n", atomic_long_read(&cc_stats.nb_max_mem_reached));
+	seq_printf(m, "configures %ld\n", atomic_long_read(&cc_stats.nb_configures));
+	seq_printf(m, "configure_errors %ld\n", atomic_long_read(&cc_stats.nb_configure_errors));
+	seq_printf(m, "faults %ld\n", atomic_long_read(&cc_stats.nb_faults));
+	seq_puts(m, "configure_latency_us\n");
+	for (i = 0; i < CC_STATS_LATENCY_BUCKETS; ++i)
+		seq_printf(m, "  < %lu: %ld\n", 1UL << i, atomic_long_read(&cc_stats.configure_latency[i]));
+	return 0;
+}
+
+// locks: uses cc_areas
+static int cc_debugfs_areas_show(struct seq_file *m, void *unused)
+{
+	struct memory_area *area;
+	mutex_lock(&cc_areas.mutex);
+	// racy reads of area fields: area locks are not taken, so that debugfs never waits for a configure
+	list_for_each_entry(area, &cc_areas.list, list)
+		seq_printf(m, "%s pages %zu configured %d vmas %d\n", area->name[0] != '\0' ? area->name : "-",
+				ACCESS_ONCE(area->store.nb_pages), ACCESS_ONCE(area->is_configured),
+				ACCESS_ONCE(area->vma_count));
+	mutex_unlock(&cc_areas.mutex);
+	return 0;
+}
+
+// locks: uses cc_claims
+static int cc_debugfs_claims_show(struct seq_file *m, void *unused)
+{
+	struct cc_group *group;
+	int c;
+	mutex_lock(&cc_claims.mutex);
+	seq_puts(m, "pages_by_color");
+	for (c = 0; c < nb_colors; ++c)
+		seq_printf(m, " %zu", cc_claims.nb_pages[c]);
+	seq_puts(m, "\nlazy_by_color");
+	for (c = 0; c < nb_colors; ++c)
+		seq_printf(m, " %zu", cc_claims.nb_lazy[c]);
+	seq_putc(m, '\n');
+	list_for_each_entry(group, &cc_claims.groups, list) {
+		seq_printf(m, "group %s max_pages %zu claimed", group->name[0] != '\0' ? group->name : "-", group->max_pages);
+		for (c = 0; c < nb_colors; ++c)
+			if (cc_claims.owners[c] == group)
+				seq_printf(m, " %d", c);
+		seq_puts(m, " pages");
+		for (c = 0; c < nb_colors; ++c)
+			if (group->nb_pages[c] > 0)
+				seq_printf(m, " %d:%zu", c, group->nb_pages[c]);
+		seq_putc(m, '\n');
+	}
+	mutex_unlock(&cc_claims.mutex);
+	return 0;
+}
+
+#define CC_DEBUGFS_FOPS(name) \
+	static int cc_debugfs_##name##_open(struct inode *inode, struct file *file) \
+	{ \
+		return single_open(file, cc_debugfs_##name##_show, NULL); \
+	} \
+	static const struct file_operations cc_debugfs_##name##_fops = { \
+		.owner = THIS_MODULE, \
+		.open = cc_debugfs_##name##_open, \
+		.read = seq_read, \
+		.llseek = seq_lseek, \
+		.release = single_release, \
+	}
+
+CC_DEBUGFS_FOPS(memory);
+CC_DEBUGFS_FOPS(stats);
+CC_DEBUGFS_FOPS(areas);
+CC_DEBUGFS_FOPS(claims);
+
+// Statistics are optional: failures (like debugfs not enabled) are ignored
+static void cc_debugfs_create(void)
+{
+	struct dentry *dir = debugfs_create_dir("ccontrol", NULL);
+	if (IS_ERR_OR_NULL(dir)) {
+		cc_stats.debugfs_dir = NULL;
+		return;
+	}
+	cc_stats.debugfs_dir = dir;
+	debugfs_create_file("memory", S_IRUSR, dir, NULL, &cc_debugfs_memory_fops);
+	debugfs_create_file("stats", S_IRUSR, dir, NULL, &cc_debugfs_stats_fops);
+	debugfs_create_file("areas", S_IRUSR, dir, NULL, &cc_debugfs_areas_fops);
+	debugfs_create_file("claims", S_IRUSR, dir, NULL, &cc_debugfs_claims_fops);
+}
+
+static void cc_debugfs_destroy(void)
+{
+	debugfs_remove_recursive(cc_stats.debugfs_dir); // no-op if NULL
+}
+
 /* -------------- Entry points --------------- */
 
 static int __init ccontrol_init(void)
@@ -694,31 +4058,52 @@ static int __init ccontrol_init(void)
 		printk(KERN_ERR "ccontrol: invalid max memory argument: \"%s\"\n", max_mem);
 		return -EINVAL;
 	}
+	err = cc_colors_init();
+	if (err)
+		return err;
 	if (color_list_size_max <= 0) {
 		// if color_list_size_max is undefined, default to the number of colors
 		color_list_size_max = nb_colors;
 	}
+	if (low_watermark < 0)
+		low_watermark = 0;
+	if (high_watermark < low_watermark)
+		high_watermark = low_watermark;
 
-	printk(KERN_DEBUG "ccontrol: init max_mem=%s nb_colors=%d\n", max_mem, nb_colors);
+	printk(KERN_DEBUG "ccontrol: init max_mem=%s nb_colors=%d (cache=%d, inner=%d, bank=%d) color_fn=%s preallocate=%d\n",
+			max_mem, nb_colors, cc_colors.nb_cache_colors, cc_colors.nb_inner_colors, cc_colors.nb_bank_colors,
+			color_fn, preallocate);
 
-	err = cc_device_create();
+	mutex_init(&cc_areas.mutex);
+	INIT_LIST_HEAD(&cc_areas.list);
+	err = cc_claims_init();
 	if (err)
-		goto err_device_create;
+		return err;
+
+	// storage (with its workers and shrinker) must be ready before the device can be opened
 	err = cc_memory_init(max_memory);
 	if (err)
 		goto err_mem_init;
+	err = cc_device_create();
+	if (err)
+		goto err_device_create;
+	cc_debugfs_create();
 	return 0;
 
-err_mem_init:
-	cc_device_destroy();
 err_device_create:
+	cc_memory_destroy();
+err_mem_init:
+	cc_claims_destroy();
 	return err;
 }
 
 static void __exit ccontrol_exit(void)
 {
-	cc_memory_destroy();
+	cc_debugfs_destroy();
 	cc_device_destroy();
+	cc_memory_destroy_named_areas();
+	cc_memory_destroy();
+	cc_claims_destroy();
 	printk(KERN_DEBUG "ccontrol: exit\n");
 }
 
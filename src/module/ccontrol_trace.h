@@ -0,0 +1,141 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * Copyright (C) 2015 Francois Gindraud <francois.gindraud@inria.fr>
+ */
+
+/* Tracepoints of the ccontrol module (events/ccontrol in ftrace, ccontrol:* in perf).
+ * Durations are in microseconds, err is 0 or a negative errno.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ccontrol
+
+#if !defined(CCONTROL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define CCONTROL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// A block was split into colored storage (from a free unsplit block, or a new kernel allocation)
+TRACE_EVENT(ccontrol_refill,
+	TP_PROTO(int node, unsigned long pfn, int from_free_block, s64 duration, int err),
+	TP_ARGS(node, pfn, from_free_block, duration, err),
+	TP_STRUCT__entry(
+		__field(int, node)
+		__field(unsigned long, pfn)
+		__field(int, from_free_block)
+		__field(s64, duration)
+		__field(int, err)
+	),
+	TP_fast_assign(
+		__entry->node = node;
+		__entry->pfn = pfn;
+		__entry->from_free_block = from_free_block;
+		__entry->duration = duration;
+		__entry->err = err;
+	),
+	TP_printk("node=%d pfn=0x%lx from_free_block=%d duration=%lldus err=%d",
+		__entry->node, __entry->pfn, __entry->from_free_block, __entry->duration, __entry->err)
+);
+
+// Area configuration (first color of the list, -1 for a color map, and total number of pages)
+TRACE_EVENT(ccontrol_configure,
+	TP_PROTO(struct cc_layout *config, size_t nb_pages, s64 duration, int err),
+	TP_ARGS(config, nb_pages, duration, err),
+	TP_STRUCT__entry(
+		__field(int, first_color)
+		__field(int, nb_colors)
+		__field(int, color_repeat)
+		__field(int, list_repeat)
+		__field(int, node)
+		__field(size_t, nb_pages)
+		__field(s64, duration)
+		__field(int, err)
+	),
+	TP_fast_assign(
+		__entry->first_color = config->color_list != NULL ? config->color_list[0] : -1;
+		__entry->nb_colors = config->nb_colors;
+		__entry->color_repeat = config->color_repeat;
+		__entry->list_repeat = config->list_repeat;
+		__entry->node = config->node;
+		__entry->nb_pages = nb_pages;
+		__entry->duration = duration;
+		__entry->err = err;
+	),
+	TP_printk("color=%d nb_colors=%d color_repeat=%d list_repeat=%d node=%d nb_pages=%zu duration=%lldus err=%d",
+		__entry->first_color, __entry->nb_colors, __entry->color_repeat, __entry->list_repeat,
+		__entry->node, __entry->nb_pages, __entry->duration, __entry->err)
+);
+
+// Page fault, with the mapped window [first, last[ (page offsets in the area)
+TRACE_EVENT(ccontrol_fault,
+	TP_PROTO(size_t index, unsigned long pfn, int color, size_t first, size_t last, int ret),
+	TP_ARGS(index, pfn, color, first, last, ret),
+	TP_STRUCT__entry(
+		__field(size_t, index)
+		__field(unsigned long, pfn)
+		__field(int, color)
+		__field(size_t, first)
+		__field(size_t, last)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->pfn = pfn;
+		__entry->color = color;
+		__entry->first = first;
+		__entry->last = last;
+		__entry->ret = ret;
+	),
+	TP_printk("index=%zu pfn=0x%lx color=%d window=[%zu,%zu[ ret=0x%x",
+		__entry->index, __entry->pfn, __entry->color, __entry->first, __entry->last, __entry->ret)
+);
+
+// Area mmap of nb_pages pages at offset pgoff
+TRACE_EVENT(ccontrol_mmap,
+	TP_PROTO(unsigned long pgoff, size_t nb_pages, int populate, s64 duration, int err),
+	TP_ARGS(pgoff, nb_pages, populate, duration, err),
+	TP_STRUCT__entry(
+		__field(unsigned long, pgoff)
+		__field(size_t, nb_pages)
+		__field(int, populate)
+		__field(s64, duration)
+		__field(int, err)
+	),
+	TP_fast_assign(
+		__entry->pgoff = pgoff;
+		__entry->nb_pages = nb_pages;
+		__entry->populate = populate;
+		__entry->duration = duration;
+		__entry->err = err;
+	),
+	TP_printk("pgoff=%lu nb_pages=%zu populate=%d duration=%lldus err=%d",
+		__entry->pgoff, __entry->nb_pages, __entry->populate, __entry->duration, __entry->err)
+);
+
+// Area destruction, pages go back to storage
+TRACE_EVENT(ccontrol_destroy_area,
+	TP_PROTO(size_t nb_pages, s64 duration),
+	TP_ARGS(nb_pages, duration),
+	TP_STRUCT__entry(
+		__field(size_t, nb_pages)
+		__field(s64, duration)
+	),
+	TP_fast_assign(
+		__entry->nb_pages = nb_pages;
+		__entry->duration = duration;
+	),
+	TP_printk("nb_pages=%zu duration=%lldus", __entry->nb_pages, __entry->duration)
+);
+
+#endif /* CCONTROL_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ccontrol_trace
+#include <trace/define_trace.h>
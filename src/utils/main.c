@@ -29,6 +29,12 @@
 char * arg_max_mem = "1M";
 int arg_colors = -1;
 int arg_is_color_cache_level = 0;
+int arg_inner_colors = -1;
+int arg_is_inner_color_cache_level = 0;
+int arg_preallocate = 0;
+char * arg_color_bits = NULL;
+char * arg_color_masks = NULL;
+char * arg_bank_masks = NULL;
 
 /* utils */
 
@@ -180,25 +186,25 @@ static int scan_sys_cache_info (void) {
 	return 0;
 }
 
-static int get_nb_color (void) {
+static int get_nb_color (int colors, int is_color_cache_level) {
 	// use manual setting
-	if (arg_colors > 0 && !arg_is_color_cache_level) {
-		printf ("Using manual color number = %d\n", arg_colors);
-		return arg_colors;
+	if (colors > 0 && !is_color_cache_level) {
+		printf ("Using manual color number = %d\n", colors);
+		return colors;
 	}
 
 	// use autodetect : get cache info
-	int l = arg_colors;
-	if (scan_sys_cache_info () != 0)
+	int l = colors;
+	if (caches == NULL && scan_sys_cache_info () != 0)
 		error (EXIT_FAILURE, 0, "unable to get cache information");
 
 	// guided autodetect
-	if (l >= 0 && arg_is_color_cache_level) {
+	if (l >= 0 && is_color_cache_level) {
 		if (l < nb_cache_levels && caches[l].found) {
 			printf ("Using L%d color setting = %d\n", l, caches[l].nb_colors);
 			return caches[l].nb_colors;
 		} else {
-			printf ("L%d cache information not found, using LLC\n", arg_colors);
+			printf ("L%d cache information not found, using LLC\n", colors);
 		}
 	}
 
@@ -219,13 +225,41 @@ static int get_nb_color (void) {
  * info: print cache stats
  */
 static int load_module (void) {
-	char argm[80], argc[80];
+	char argm[80], argc[80], argf[200], argb[200], argi[80];
+	char * args[] = { "modprobe", "ccontrol", argm, argc, NULL, NULL, NULL, NULL, NULL };
+	int nb_args = 4;
 	assert (snprintf (argm, 80, "max_mem=%s", arg_max_mem) > 0);
-	assert (snprintf (argc, 80, "nb_colors=%d", get_nb_color ()) > 0);
-
-	printf ("Loading module using \"modprobe ccontrol %s %s\"\n", argm, argc);
-	if (execlp ("modprobe", "modprobe", "ccontrol", argm, argc, NULL) < 0)
-		error (EXIT_FAILURE, errno, "execlp modprobe");
+	if (arg_color_bits != NULL) {
+		// number of colors is given by the color function
+		assert (snprintf (argc, 80, "color_fn=bits") > 0);
+		assert (snprintf (argf, 200, "color_bits=%s", arg_color_bits) > 0);
+		args[nb_args++] = argf;
+	} else if (arg_color_masks != NULL) {
+		assert (snprintf (argc, 80, "color_fn=xor") > 0);
+		assert (snprintf (argf, 200, "color_masks=%s", arg_color_masks) > 0);
+		args[nb_args++] = argf;
+	} else {
+		assert (snprintf (argc, 80, "nb_colors=%d", get_nb_color (arg_colors, arg_is_color_cache_level)) > 0);
+	}
+	if (arg_inner_colors >= 0) {
+		printf ("Inner level: ");
+		assert (snprintf (argi, 80, "nb_inner_colors=%d",
+					get_nb_color (arg_inner_colors, arg_is_inner_color_cache_level)) > 0);
+		args[nb_args++] = argi;
+	}
+	if (arg_bank_masks != NULL) {
+		assert (snprintf (argb, 200, "bank_masks=%s", arg_bank_masks) > 0);
+		args[nb_args++] = argb;
+	}
+	if (arg_preallocate)
+		args[nb_args++] = "preallocate=1";
+
+	printf ("Loading module using \"modprobe");
+	for (int i = 1; i < nb_args; ++i)
+		printf (" %s", args[i]);
+	printf ("\"\n");
+	if (execvp ("modprobe", args) < 0)
+		error (EXIT_FAILURE, errno, "execvp modprobe");
 	return EXIT_FAILURE; // should never be reached
 }
 
@@ -250,6 +284,24 @@ static int cmd_info(void)
 			printf ("L%-5d %10s %9zu%c %10d %10d\n", level, i->type, sz, sx, i->assoc, i->nb_colors);
 		}
 	}
+
+	/* With modulo coloring, colors of a level nest in colors of an outer level if they divide them
+	 * (both can be used at once, see --inner-colors).
+	 */
+	for (int inner = 0; inner < nb_cache_levels; ++inner) {
+		if (!caches[inner].found)
+			continue;
+		for (int outer = inner + 1; outer < nb_cache_levels; ++outer) {
+			if (!caches[outer].found)
+				continue;
+			int ci = caches[inner].nb_colors, co = caches[outer].nb_colors;
+			if (ci > 0 && co % ci == 0)
+				printf ("L%d colors nest in L%d colors: L%d color c contains L%d colors c + k * %d (k < %d)\n",
+						inner, outer, inner, outer, ci, co / ci);
+			else
+				printf ("L%d colors do not nest in L%d colors\n", inner, outer);
+		}
+	}
 	return EXIT_SUCCESS;
 }
 
@@ -261,6 +313,11 @@ void print_help (void) {
 	printf ("--version,-V                   : print program version\n");
 	printf ("--max_mem,-m <string>          : maximum memory allocated to the module\n");
 	printf ("--colors,-c <uint/\"L<int>\">  : colors used by the module\n");
+	printf ("--inner-colors <uint/\"L<int>\">: colors of an inner cache level, nested in colors (like L2 in L3)\n");
+	printf ("--preallocate,-p               : allocate all of max_mem when loading the module\n");
+	printf ("--color-bits <first>,<nb>      : color is physical address bits [first, first+nb)\n");
+	printf ("--color-masks <mask>,...       : color bit i is the parity of (physical address & mask i)\n");
+	printf ("--bank-masks <mask>,...        : also color by DRAM bank, bank bit i is the parity of (address & mask i)\n");
 	printf ("Available commands:\n");
 	printf ("load                           : load kernel module\n");
 	printf ("unload                         : unload kernel module\n");
@@ -276,9 +333,14 @@ int main (int argc, char * argv[]) {
 		{ "version", no_argument, &ask_version, 1},
 		{ "max_mem", required_argument, NULL, 'm' },
 		{ "colors", required_argument, NULL, 'c' },
+		{ "preallocate", no_argument, NULL, 'p' },
+		{ "color-bits", required_argument, NULL, 'b' },
+		{ "color-masks", required_argument, NULL, 'x' },
+		{ "bank-masks", required_argument, NULL, 'k' },
+		{ "inner-colors", required_argument, NULL, 'i' },
 		{ 0, 0 , 0, 0},
 	};
-	const char * short_opts ="hVm:c:";
+	const char * short_opts ="hVm:c:p";
 	int c;
 	int option_index = 0;
 
@@ -306,6 +368,30 @@ int main (int argc, char * argv[]) {
 			case 'm':
 				arg_max_mem = optarg;
 				break;
+			case 'p':
+				arg_preallocate = 1;
+				break;
+			case 'b':
+				arg_color_bits = optarg;
+				break;
+			case 'x':
+				arg_color_masks = optarg;
+				break;
+			case 'k':
+				arg_bank_masks = optarg;
+				break;
+			case 'i':
+				{
+					char * opt = optarg;
+					if (opt[0] == 'L') {
+						arg_is_inner_color_cache_level = 1;
+						opt++;
+					}
+					arg_inner_colors = atoi (opt);
+					if (arg_inner_colors < 0)
+						error (EXIT_FAILURE, 0, "invalid --inner-colors value \"%s\"", optarg);
+				}
+				break;
 			case 'h':
 				ask_help = 1;
 				break;